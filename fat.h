@@ -0,0 +1,135 @@
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// File Attributes Flags
+#define FAF_READ_ONLY (char)0x01
+#define FAF_HIDDEN_FILE (char)0x02
+#define FAF_SYSTEM_FILE (char)0x04
+#define FAF_VOL_LABEL (char)0x08
+#define FAF_LFN (char)0x0F
+#define FAF_DIR (char)0x10
+#define FAF_ARCHIVE (char)0x20
+
+// File Entry 1st Byte: unallocated/deleted
+#define FEI_UNALLOC (char)0x00
+#define FEI_DELETED (char)0xe5
+
+// FAT entry values; bad and end-of-chain markers depend on the FAT variant
+#define FEV_FREE 0x0000
+#define FEV_MIN 0x0002
+#define FEV12_BAD 0xFF7
+#define FEV12_EOC 0xFF8
+#define FEV16_BAD 0xFFF7
+#define FEV16_EOC 0xFFF8
+#define FEV32_BAD 0x0FFFFFF7
+#define FEV32_EOC 0x0FFFFFF8
+#define FEV32_MASK 0x0FFFFFFF // top 4 bits of FAT32 entries are reserved
+
+// Cluster counts separating the variants
+#define FAT12_MAX_CLUSTERS 4084
+#define FAT16_MAX_CLUSTERS 65524
+
+// FSInfo sector signatures and "unknown" free count
+#define FSI_LEAD_SIG 0x41615252
+#define FSI_STRUCT_SIG 0x61417272
+#define FSI_UNKNOWN 0xFFFFFFFF
+
+typedef struct __attribute__ ((__packed__)) boot {
+    char assembly_code[3]; // instructions to jump to boot code
+    char oem[8]; // in ASCII
+    short bytes_per_sector; // 512,1024,2048,4096
+    unsigned char sectors_per_cluster; // must be a power of 2 and cluster size must be <=32 KB
+    unsigned short reserved_area_size; // in sectors
+    unsigned char number_of_fats; // usually 2
+    unsigned short max_files_in_root; // 0 for FAT32
+    unsigned short sectors_in_fs; // if 2B is not large enough, set to 0 and user 4B value in bytes 32-35
+    char media_type; // 0xf0 = removable, 0xf8 = fixed
+    unsigned short size_of_fat; // in sectors, 0 for FAT32
+    unsigned short sectors_per_track;
+    unsigned short heads;
+    uint32_t sectors_before_start; // before the start partition
+    uint32_t sectors_in_fs_large;
+    char drive_number; // BIOS INT 13h (low level disk services) drive number
+    char not_used_01;
+    char boot_signature; // to validate next three fields (0x29)
+    uint32_t vol_serial_number;
+    char vol_label[11]; // in ASCII
+    char fs_type[8]; // in ASCII
+    char not_used_02[448];
+    short signature_value; // 0xaa55
+} boot_t;
+
+// FAT32 boot record, the same as boot_t up to sectors_in_fs_large
+typedef struct __attribute__ ((__packed__)) boot32 {
+    char common[36];
+    uint32_t size_of_fat32; // in sectors
+    unsigned short ext_flags; // bits 0-3: active FAT, bit 7: mirroring disabled
+    unsigned short fs_version;
+    uint32_t root_cluster; // first cluster of the root directory
+    unsigned short fsinfo_sector; // in sectors from the volume start
+    unsigned short backup_boot_sector;
+    char reserved[12];
+    char drive_number;
+    char not_used_01;
+    char boot_signature;
+    uint32_t vol_serial_number;
+    char vol_label[11];
+    char fs_type[8];
+    char not_used_02[420];
+    short signature_value; // 0xaa55
+} boot32_t;
+
+typedef struct __attribute__ ((__packed__)) fsinfo {
+    uint32_t lead_signature; // 0x41615252
+    char reserved1[480];
+    uint32_t struct_signature; // 0x61417272
+    uint32_t free_count; // last known free cluster count, 0xFFFFFFFF if unknown
+    uint32_t next_free; // hint where to look for a free cluster
+    char reserved2[12];
+    uint32_t trail_signature; // 0xaa550000
+} fsinfo_t;
+
+typedef struct __attribute__ ((__packed__)) entry_data {
+    char filename[11]; // 8 - filename, 3 - extension, also first char is an allocation status: 0x00=unallocated, 0xe5=deleted
+    char attributes;
+    char reserved;
+    char creation_time_tenths; // in tenths of seconds
+    short creation_time; // hr=5b, min=6b, sec=5b
+    short creation_date; // yr=7b, mon=4b, day=5b
+    short access_date; // yr=7b, mon=4b, day=5b
+    unsigned short high_order_address_bytes; // High-order 2 bytes of address of first cluster (0 for FAT12/16)
+    short modified_time; // hr=5b, min=6b, sec=5b
+    short modified_date; // yr=7b, mon=4b, day=5b
+    unsigned short low_order_address_bytes; // Low-order 2 bytes of address of first cluster
+    uint32_t file_size; // if directory = 0
+} entry_data_t;
+
+typedef struct __attribute__ ((__packed__)) longfilename {
+    char entry_order; // The order of this entry in the sequence of long file name entries. This value helps you to know where in the file's name the characters from this entry should be placed. 
+    short filename1[5]; // first 5 characters
+    char attributes; // always should equal 0x0F (the long file name attribute)
+    char long_entry_type; // 0 for name entries
+    char checksum; // generated of the short file name when the file was created. The short filename can change without changing the long filename in cases where the partition is mounted on a system which does not support long filenames.
+    short filename2[6]; // next 6 characters
+    char zero_here; // always 0
+    short filename3[2]; // last 2 characters of this entry
+} lfn_t;
+
+typedef struct fatum_date {
+    short year;
+    char month;
+    char day;
+} filedate_t;
+
+typedef struct fatum_time {
+    char hrs;
+    char min;
+    char sec;
+} filetime_t;
+
+// http://www.c-jump.com/CIS24/Slides/FAT/lecture.html#F01_0030_layout
+
+#endif //FAT_H
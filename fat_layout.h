@@ -0,0 +1,35 @@
+#ifndef FAT_LAYOUT_H
+#define FAT_LAYOUT_H
+
+// Private to libfatum.c and fatum.c: the layout macros read a boot_t named br from the caller's scope
+#include "fat.h"
+
+// Datetime masks and shifts
+#define DAT_YEAR 0xFE00
+#define DAT_MONTH 0x1E0
+#define DAT_DAY 0x1F
+#define DAT_HOUR 0xF800
+#define DAT_MIN 0x7E0
+#define DAT_SEC 0x1F
+
+#define SHIFT_YEAR 9
+#define SHIFT_MONTH 5
+#define SHIFT_HOUR 11
+#define SHIFT_MIN 5
+
+// FAT and root dir sizes in sectors (FAT32 keeps the FAT size in its extended boot record and has no fixed root dir)
+#define FAT_SECTORS ((uint64_t)(br.size_of_fat ? br.size_of_fat : ((boot32_t*)&br)->size_of_fat32))
+#define ROOT_SECTORS ((br.max_files_in_root*sizeof(entry_data_t)+br.bytes_per_sector-1)/br.bytes_per_sector)
+
+// fseek locations
+#define LOC_VOLSTART 0
+#define LOC_FAT1START (LOC_VOLSTART+((br.reserved_area_size*br.bytes_per_sector)/512))
+#define LOC_FAT2START (LOC_FAT1START+((FAT_SECTORS*br.bytes_per_sector)/512))
+#define LOC_ROOTSTART (LOC_FAT1START+((FAT_SECTORS*br.number_of_fats*br.bytes_per_sector)/512))
+#define LOC_DATASTART (LOC_ROOTSTART+((ROOT_SECTORS*br.bytes_per_sector)/512))
+#define LOC_CLUSTER(n) (LOC_DATASTART+(n-2)*((br.sectors_per_cluster*br.bytes_per_sector)/512))
+
+// Cluster offset (from data block start)
+#define JMP_CLUSTER(n) (n-2)*br.sectors_per_cluster*br.bytes_per_sector
+
+#endif //FAT_LAYOUT_H
@@ -1,129 +1,66 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
 #include "fatum.h"
+#include "fat_layout.h"
+#include "server.h"
 
 #define DEBUG 1
 
+fatum_t *vol;
+fatum_table_t *table;
 boot_t br;
 char **fats;
 entry_data_t *root;
-char *data;
 
 char filename[256];
 history_t history;
 
-size_t readblock(void* buffer, uint32_t first_block, size_t block_count) {
-    if(buffer==NULL || filename==NULL) {
-        return 0;
-    }
-    FILE *f = fopen(filename, "rb");
-    if (f==NULL) {
-        return 0;
-    }
-    fseek(f,first_block*512,SEEK_SET);
-    int ret = fread(buffer,512,block_count,f);
-    fclose(f);
-    if(ret!=block_count) {
-        return 0;
-    }
-    return block_count;
-}
-
 int load_disk() {
-    if (filename==NULL) {
+    int ret = fatum_open(filename,&vol);
+    if(ret==1) {
         printf("Error: No filename\n");
         return 1;
     }
-    
-    int ret = readblock(&br,LOC_VOLSTART,1);
-    if(!ret) {
-        printf("Reading boot record failed\n");
+    if(ret==2) {
+        printf("Error: Can't read disk data\n");
         return 2;
     }
-    fats = malloc(sizeof(char*)*br.number_of_fats);
-    if(fats==NULL) {
-        printf("Error: Can't allocate memory for FATs\n");
+    if(ret==3) {
+        printf("Error: Can't allocate memory for disk data\n");
         return 3;
     }
-
-    for (int i=0; i<br.number_of_fats; i++) {
-        fats[i]=calloc(1,br.size_of_fat*br.bytes_per_sector);
-        if(fats[i]==NULL) {
-            for(int j=0; j<i; j++) free(fats[j]);
-            free(fats);
-            printf("Error: Can't allocate memory for FAT %d\n",i);
-            return 3;
-        }
-    }
-
-    for (int i=0; i<br.number_of_fats; i++) {
-        ret = readblock(fats[i], LOC_FAT1START+((br.size_of_fat*br.bytes_per_sector)/512*i), (br.size_of_fat*br.bytes_per_sector)/512);
-        if(!ret) {
-            for(int j=0; j<br.number_of_fats; j++) free(fats[j]);
-            free(fats);
-            printf("Error: Can't read FAT %d data\n",i);
-            return 2;
-        }
-    }
-
-    root = calloc(1,sizeof(entry_data_t)*br.max_files_in_root);
-    if(root==NULL) {
-        for(int j=0; j<br.number_of_fats; j++) free(fats[j]);
-        free(fats);
-        printf("Error: Can't allocate memory for root dir\n");
-        return 3;
-    }
-
-    ret = readblock(root, LOC_ROOTSTART, (sizeof(entry_data_t)*br.max_files_in_root)/512);
-    if(!ret) {
-        for(int j=0; j<br.number_of_fats; j++) free(fats[j]);
-        free(fats);
-        free(root);
-        printf("Error: Can't read root data\n");
-        return 2;
-    }
-
-    uint32_t root_sectors = sizeof(entry_data_t)*br.max_files_in_root/br.bytes_per_sector;
-    uint32_t sectors_in_fs;
-    if(br.sectors_in_fs>br.sectors_in_fs_large) sectors_in_fs=br.sectors_in_fs;
-    else sectors_in_fs=br.sectors_in_fs_large;
-    uint32_t data_sectors = sectors_in_fs-br.reserved_area_size-br.number_of_fats*br.size_of_fat-root_sectors;
-    
-    data = calloc(1,data_sectors*br.bytes_per_sector);
-    if(data==NULL) {
-        for(int j=0; j<br.number_of_fats; j++) free(fats[j]);
-        free(fats);
-        free(root);
-        printf("Error: Can't allocate memory for data block\n");
-        return 3;
-    }
-
-    ret = readblock(data, LOC_DATASTART, (data_sectors*br.bytes_per_sector)/512);
-    if(!ret) {
-        for(int j=0; j<br.number_of_fats; j++) free(fats[j]);
-        free(fats);
-        free(root);
-        free(data);
-        printf("Error: Can't read data\n");
-        return 2;
-    }
-
+    br = vol->br;
+    fats = vol->fats;
+    root = vol->root ? vol->root : (entry_data_t*)fatum_cluster_ptr(vol,vol->root_cluster);
     return 0;
 }
 
 void command_prompt() {
-    printf("Fatum v0.000001\n");
+    // Prompts are left out when commands come from a pipe, so output like tar's stays clean
+    char interactive = isatty(STDIN_FILENO);
+    if(interactive) printf("Fatum v0.000001\n");
     char buffer[256]="";
     char fn[13];
     entry_data_t *current = root;
     while(1) {
-        if(history.size==0) printf("\\");
-        else printf("%s",history.dirs[history.size-1]);
-        printf("> ");
-        scanf("%[^\n]s\n",buffer);
+        if(interactive) {
+            if(history.size==0) printf("\\");
+            else printf("%s",history.dirs[history.size-1]);
+            printf("> ");
+        }
+        fflush(stdout);
+        buffer[0]='\0';
+        if(scanf("%255[^\n]",buffer)==EOF) {
+            prepare_for_exit();
+            break;
+        }
         flush_scan();
         if(!strcmp(buffer,"exit")) {
             prepare_for_exit();
@@ -164,7 +101,7 @@ void command_prompt() {
                     continue;
                 }
                 strcpy(fn,dir->filename);
-                format_filename(fn,fn);
+                fatum_format_filename(fn,fn);
                 entry_data_t *fetched = fetch_dir(dir);
                 if(fetched==NULL) {
                     printf("%s is not a directory.\n", buffer+3);
@@ -210,18 +147,85 @@ void command_prompt() {
                 continue;
             }
             if (buffer[3]==' ') {
-                entry_data_t *f = find_entry(current,buffer+4);
+                char *name = buffer+4;
+                uint32_t offset = 0;
+                uint32_t len = UINT32_MAX;
+                char ranged = 0;
+                while(name && name[0]=='-') {
+                    if(name[1]=='o') name = parse_num_option(name,&offset);
+                    else if(name[1]=='n') name = parse_num_option(name,&len);
+                    else name = NULL;
+                    ranged = 1;
+                }
+                if(name==NULL) {
+                    printf("syntax: cat [-o offset] [-n length] file-name\n");
+                    continue;
+                }
+                entry_data_t *f = find_entry(current,name);
                 if(f==NULL) {
-                    printf("No file named %s found.\n",buffer+4);
+                    printf("No file named %s found.\n",name);
                     continue;
                 }
-                int status = print_file_contents(f);
+                int status;
+                if(ranged) status = print_file_range(f,offset,len);
+                else status = print_file_contents(f);
                 if(status==-1 || status==-2) {
                     printf("Wrong filename.\n");
                     continue;
                 }
                 if(status==-3) {
-                    printf("%s is a directory.\n",buffer+4);
+                    printf("%s is a directory.\n",name);
+                    continue;
+                }
+                if(status==-4 && ranged) {
+                    printf("Cluster corrupted\n");
+                    continue;
+                }
+                if(status==-5) {
+                    printf("Error: allocation error\n");
+                    continue;
+                }
+            }
+            else printf("What is a %s? A miserable pile of letters?\n", buffer);
+        }
+        else if (!strncmp(buffer,"head",4) || !strncmp(buffer,"tail",4)) {
+            if (buffer[4]=='\0') {
+                printf("No filename\n");
+                continue;
+            }
+            if (buffer[4]==' ') {
+                char *name = buffer+5;
+                uint32_t lines = 10;
+                if(name[0]=='-') {
+                    if(name[1]=='n') name = parse_num_option(name,&lines);
+                    else name = NULL;
+                }
+                if(name==NULL) {
+                    printf("syntax: %.4s [-n lines] file-name\n",buffer);
+                    continue;
+                }
+                entry_data_t *f = find_entry(current,name);
+                if(f==NULL) {
+                    printf("No file named %s found.\n",name);
+                    continue;
+                }
+                int status;
+                if(buffer[0]=='h') status = print_file_head(f,lines);
+                else status = print_file_tail(f,lines);
+                if(status==-1 || status==-2) {
+                    printf("Wrong filename.\n");
+                    continue;
+                }
+                if(status==-3) {
+                    printf("%s is a directory.\n",name);
+                    continue;
+                }
+                if(status==-4) {
+                    printf("\nCluster corrupted\n");
+                    continue;
+                }
+                if(status==-5) {
+                    printf("Error: allocation error\n");
                     continue;
                 }
             }
@@ -285,8 +289,8 @@ void command_prompt() {
         else if (!strcmp(buffer,"rootinfo")) {
             print_root_info();
         }
-        else if (!strcmp(buffer,"spaceinfo")) {
-            print_space_info();
+        else if (!strcmp(buffer,"spaceinfo") || !strcmp(buffer,"spaceinfo -f")) {
+            print_space_info(buffer[9]!='\0');
         }
         else if (!strncmp(buffer,"fileinfo",8)) {
             if (buffer[8]=='\0') {
@@ -303,22 +307,174 @@ void command_prompt() {
             }
             else printf("What is a %s? A miserable pile of letters?\n", buffer);
         }
+        else if (!strncmp(buffer,"grep",4)) {
+            if (buffer[4]=='\0') {
+                printf("No pattern\n");
+                continue;
+            }
+            if (buffer[4]==' ') {
+                char *pos = buffer+5;
+                char recursive = 0;
+                if(!strncmp(pos,"-r ",3)) {
+                    recursive = 1;
+                    pos+=3;
+                }
+                char *pattern = pos;
+                char *end;
+                if(*pattern=='"') {
+                    pattern++;
+                    end = strchr(pattern,'"');
+                }
+                else end = strchr(pattern,' ');
+                char *path = NULL;
+                if(end) {
+                    *end = '\0';
+                    path = end+1;
+                    while(*path==' ') path++;
+                    if(*path=='\0') path = NULL;
+                }
+                else if(pattern!=pos) {
+                    printf("syntax: grep [-r] pattern [path]\n");
+                    continue;
+                }
+                if(*pattern=='\0') {
+                    printf("No pattern\n");
+                    continue;
+                }
+                entry_data_t *target = current==root ? NULL : current;
+                if(path) {
+                    target = find_entry(current,path);
+                    if(target==NULL) {
+                        printf("No file named %s found.\n",path);
+                        continue;
+                    }
+                }
+                int status = grep_entries(target,path,pattern,recursive);
+                if(status==-5) printf("Error: allocation error\n");
+            }
+            else printf("What is a %s? A miserable pile of letters?\n", buffer);
+        }
+        else if (!strncmp(buffer,"export",6)) {
+            if (buffer[6]!='\0' && buffer[6]!=' ') {
+                printf("What is a %s? A miserable pile of letters?\n", buffer);
+                continue;
+            }
+            char csv = 0;
+            char *output = NULL;
+            char wrong = 0;
+            char *arg = strtok(buffer+6," ");
+            while(arg) {
+                if(!strcmp(arg,"-f")) {
+                    arg = strtok(NULL," ");
+                    if(arg && !strcmp(arg,"csv")) csv = 1;
+                    else if(arg && !strcmp(arg,"jsonl")) csv = 0;
+                    else wrong = 1;
+                }
+                else if(!strcmp(arg,"-o")) {
+                    output = strtok(NULL," ");
+                    if(output==NULL) wrong = 1;
+                }
+                else wrong = 1;
+                if(wrong) break;
+                arg = strtok(NULL," ");
+            }
+            if(wrong) {
+                printf("syntax: export [-f jsonl|csv] [-o output-file]\n");
+                continue;
+            }
+            int status = export_manifest(csv,output);
+            if(status==-5) printf("Can't open file\n");
+            else if(status==-6) printf("Error: write error\n");
+        }
+        else if (!strncmp(buffer,"query",5)) {
+            if (buffer[5]!='\0' && buffer[5]!=' ') {
+                printf("What is a %s? A miserable pile of letters?\n", buffer);
+                continue;
+            }
+            fatum_query_t q;
+            fatum_query_init(&q);
+            char *arg = strtok(buffer+5," ");
+            char *wrong = NULL;
+            while(arg && !wrong) {
+                if(parse_query_arg(arg,&q)) wrong = arg;
+                arg = strtok(NULL," ");
+            }
+            if(wrong) {
+                printf("What is a %s? A miserable pile of letters?\n", wrong);
+                printf("syntax: query [size>N] [size<N] [mtime>YYYY-MM-DD[THH:MM]] [mtime<YYYY-MM-DD[THH:MM]] [+ARSHDV] [-ARSHDV]\n");
+                continue;
+            }
+            int status = run_query(&q);
+            if(status==-5) printf("Error: allocation error\n");
+        }
+        else if (!strncmp(buffer,"tar",3)) {
+            if (buffer[3]=='\0') {
+                printf("No directory name\n");
+                continue;
+            }
+            if (buffer[3]==' ') {
+                char *name = strtok(buffer+4," ");
+                char *output = NULL;
+                char *arg = strtok(NULL," ");
+                char wrong = name==NULL;
+                if(arg && !strcmp(arg,"-o")) {
+                    output = strtok(NULL," ");
+                    if(output==NULL || strtok(NULL," ")) wrong = 1;
+                }
+                else if(arg) wrong = 1;
+                if(wrong) {
+                    printf("syntax: tar directory-name [-o output-file|-]\n");
+                    continue;
+                }
+                entry_data_t *dir = NULL;
+                if(strcmp(name,"\\")) {
+                    dir = find_entry(current,name);
+                    if(dir==NULL) {
+                        printf("No directory named %s found.\n",name);
+                        continue;
+                    }
+                    if(!(dir->attributes & FAF_DIR)) {
+                        printf("%s is not a directory.\n",name);
+                        continue;
+                    }
+                }
+                if(output && !strcmp(output,"-")) output = NULL;
+                int status = tar_export(dir,output);
+                if(status==-5) fprintf(stderr,"Can't open file\n");
+                else if(status==-6) fprintf(stderr,"Error: write error\n");
+                else if(status) fprintf(stderr,"Error: archive left incomplete\n");
+            }
+            else printf("What is a %s? A miserable pile of letters?\n", buffer);
+        }
         else if (!strcmp(buffer,"help")) {
             printf("dir - shows current directory's contents. You can also give a dir name to show its contents.\n");
             printf("     syntax: dir [directory-name]\n");
             printf("cd - changes current directory.\n");
             printf("     syntax: cd directory-name\n");
             printf("pwd - displays current directory's full path.\n");
-            printf("cat - shows file's contents.\n");
-            printf("     syntax: cat file-name\n");
+            printf("cat - shows file's contents. You can also give a byte offset and length to show only a part of it.\n");
+            printf("     syntax: cat [-o offset] [-n length] file-name\n");
+            printf("head - shows first lines of a file (10 by default).\n");
+            printf("     syntax: head [-n lines] file-name\n");
+            printf("tail - shows last lines of a file (10 by default).\n");
+            printf("     syntax: tail [-n lines] file-name\n");
             printf("get - saves file to the host's folder.\n");
             printf("     syntax: get file-name\n");
             printf("zip - gets 2 files and mixes its contents to a new file.\n");
             printf("     syntax: zip file1-name file2-name output-file-name\n");
             printf("rootinfo - prints root directory info.\n");
-            printf("spaceinfo - prints volume information.\n");
+            printf("spaceinfo - prints volume information. On FAT32 the free count comes from FSInfo unless -f is given.\n");
+            printf("     syntax: spaceinfo [-f]\n");
             printf("fileinfo - prints file details.\n");
             printf("     syntax: fileinfo file-name\n");
+            printf("grep - searches files' contents for a pattern. Use -r to search subdirectories too.\n");
+            printf("     syntax: grep [-r] pattern [path]\n");
+            printf("export - writes one record per entry of the whole volume as JSON Lines (default) or CSV.\n");
+            printf("     syntax: export [-f jsonl|csv] [-o output-file]\n");
+            printf("query - lists entries of the whole volume matching all given conditions. +X/-X requires attribute X to be set/clear.\n");
+            printf("     syntax: query [size>N] [size<N] [mtime>YYYY-MM-DD[THH:MM]] [mtime<YYYY-MM-DD[THH:MM]] [+ARSHDV] [-ARSHDV]\n");
+            printf("tar - writes a directory with its subdirectories as a tar archive, to standard output by default. \\ is the root directory.\n");
+            printf("     syntax: tar directory-name [-o output-file|-]\n");
             printf("help - prints this very useful guide\n");
         }
         else if (!strcmp(buffer,"version")) {
@@ -331,11 +487,8 @@ void command_prompt() {
 }
 
 void prepare_for_exit() {
-    if (root) free(root);
-    if (fats) {
-        for (int i=0; i<br.number_of_fats; i++) if(fats[i]) free(fats[i]);
-        free(fats);
-    }
+    fatum_table_free(table);
+    fatum_close(vol);
     if (history.dirs) {
         while(history.size>0) {
             if(history.dirs[history.size-1]) free(history.dirs[history.size-1]);
@@ -343,7 +496,6 @@ void prepare_for_exit() {
         }
         free(history.dirs);
     }
-    if (data) free(data);
 }
 
 void show_dir_content(entry_data_t *first_entry) {
@@ -353,32 +505,35 @@ void show_dir_content(entry_data_t *first_entry) {
     filetime_t mt;
     short indent;
     char formatted[13];
-    unsigned short cluster;
-    unsigned short next_cluster;
-    short offset=0;
-    int cluster_size;
+    uint32_t cluster;
+    uint32_t next_cluster;
+    uint32_t offset=0;
+    uint32_t cluster_size;
 
-    if(first_entry==root) {
+    if(first_entry==root && vol->root_cluster==0) {
         cluster=0;
-        next_cluster=(unsigned short)0xFFFF;
+        next_cluster=vol->eoc;
         cluster_size=br.max_files_in_root*sizeof(entry_data_t);
     }
     else {
-        entry_data_t *pwd = find_entry(current,".");
-        if(pwd==NULL) return;
-        cluster = pwd->low_order_address_bytes;
-        next_cluster = get_fat_index(cluster,fats[0]);
+        if(first_entry==root) cluster = vol->root_cluster;
+        else {
+            entry_data_t *pwd = find_entry(current,".");
+            if(pwd==NULL) return;
+            cluster = fatum_first_cluster(vol,pwd);
+        }
+        next_cluster = get_fat_index(cluster,vol->fat);
         cluster_size = br.bytes_per_sector*br.sectors_per_cluster;
     }
     
 
     while(current->filename[0]!=FEI_UNALLOC) {
-        if(hidden_in_dir(current,1)==0) {
-            md=get_date(current->modified_date);
-            mt=get_time(current->modified_time);
+        if(fatum_hidden_in_dir(current,1)==0) {
+            md=fatum_get_date(current->modified_date);
+            mt=fatum_get_time(current->modified_time);
             printf("%02d/%02d/%04d %02d:%02d ",md.day,md.month,md.year,mt.hrs,mt.min);
             
-            format_filename(current->filename,formatted);
+            fatum_format_filename(current->filename,formatted);
             indent=13-strlen(formatted);
             printf("%s",formatted);
             for(int i=0; i<indent; i++) printf(" ");
@@ -390,10 +545,10 @@ void show_dir_content(entry_data_t *first_entry) {
 
         offset+=sizeof(entry_data_t);
         if(offset>=cluster_size) {
-            if(next_cluster>=(unsigned short)0x0002 && next_cluster<=(unsigned short)0xFFF6) {
-                current=(entry_data_t*)(data+JMP_CLUSTER(next_cluster));
+            if(fatum_valid_cluster(vol,next_cluster)) {
+                current=(entry_data_t*)(fatum_cluster_ptr(vol,next_cluster));
                 cluster=next_cluster;
-                next_cluster=get_fat_index(cluster,fats[0]);
+                next_cluster=get_fat_index(cluster,vol->fat);
                 offset=0;
             }
             else {
@@ -407,91 +562,22 @@ void show_dir_content(entry_data_t *first_entry) {
 entry_data_t *fetch_dir(entry_data_t *dir) {
     if(dir==NULL) return root;
     if(dir->attributes!=FAF_DIR) return NULL;
-    if(dir->low_order_address_bytes==(unsigned short)0x00) return root;
-    return (entry_data_t*)(data+JMP_CLUSTER(dir->low_order_address_bytes));
+    uint32_t cluster = fatum_first_cluster(vol,dir);
+    if(cluster==0 || cluster==vol->root_cluster) return root;
+    if(!fatum_valid_cluster(vol,cluster)) return NULL;
+    return (entry_data_t*)fatum_cluster_ptr(vol,cluster);
 }
 
 entry_data_t *find_entry(entry_data_t *pwd, const char *filename) {
     if(pwd==NULL || filename==NULL) return NULL;
-    int cluster_size;
-    if(pwd==root) cluster_size=br.max_files_in_root*sizeof(entry_data_t);
-    else cluster_size=br.bytes_per_sector*br.sectors_per_cluster;
-    short offset=0;
-    entry_data_t *current = pwd;
-    char formatted[13];
-    char fn[13];
-    for (int i=0; i<12; i++) fn[i]=filename[i];
-    fn[12]='\0';
-    for (int i=0; i<strlen(fn); i++) fn[i]=tolower(fn[i]);
-    while(current->filename[0]!=FEI_UNALLOC) {
-        if(hidden_in_dir(current,0)==0) {
-            format_filename(current->filename,formatted);
-            for (int i=0; i<strlen(formatted); i++) formatted[i]=tolower(formatted[i]);
-            if(!strcmp(formatted,fn)) return current;
-        }
-        offset+=sizeof(entry_data_t);
-        if(offset>=cluster_size) break;
-        current=(entry_data_t*)((char*)current+sizeof(entry_data_t));
-    }
-    return NULL;
-}
-
-int format_filename(const char *filename, char *dst) {
-    if(filename==NULL) return -1;
-    int pos=0;
-
-    for (int i=0; i<8; i++) {
-        if(filename[i]==' ') break;
-        dst[pos]=filename[i];
-        pos++;
-    }
-
-    if(filename[8]==' ') {
-        dst[pos]='\0';
-        return 0;
-    }
-    
-    dst[pos]='.';
-    pos++;
-    for (int i=0; i<3; i++) {
-        if(filename[8+i]==' ') break;
-        dst[pos]=filename[8+i];
-        pos++;
-    }
-    dst[pos]='\0';
-    return 0;  
-}
-
-int hidden_in_dir(entry_data_t *entry, char hide_dots) {
-    if(entry->filename[0]==FEI_DELETED) return 1;
-    if(entry->attributes==FAF_LFN) return 1;
-    if(hide_dots && *(entry->filename)=='.') return 1;
-    return 0;
-}
-
-unsigned short get_fat_index(unsigned int index, const char* FAT) {
-    unsigned short* fat_pointer = (unsigned short*)FAT;
-    for (int i=0; i<index; i++) {
-        fat_pointer+=1;
-    }
-    return *fat_pointer;
+    entry_data_t *found;
+    if(fatum_find(vol,pwd==root?NULL:pwd,filename,&found)) return NULL;
+    return found;
 }
 
-filedate_t get_date(short date) {
-    filedate_t fd;
-    fd.year=(date&DAT_YEAR)>>SHIFT_YEAR;
-    fd.year+=1980;
-    fd.month=(date&DAT_MONTH)>>SHIFT_MONTH;
-    fd.day=(date&DAT_DAY);
-    return fd;
-}
-
-filetime_t get_time(short time) {
-    filetime_t ft;
-    ft.hrs=(time&DAT_HOUR)>>SHIFT_HOUR;
-    ft.min=(time&DAT_MIN)>>SHIFT_MIN;
-    ft.sec=(time&DAT_SEC)*2;
-    return ft;
+uint32_t get_fat_index(uint32_t index, const char* FAT) {
+    if(index-2>=vol->cluster_count) return vol->bad;
+    return vol->fat_entry(FAT,index);
 }
 
 void print_current_dir() {
@@ -509,39 +595,138 @@ int print_file_contents(entry_data_t *file) {
     if(file==NULL) return -1;
     if(file->filename[0]==FEI_UNALLOC || file->filename[0]==FEI_DELETED) return -2;
     if(file->attributes & FAF_DIR) return -3;
-    unsigned short current = file->low_order_address_bytes;
-    if(!(current>=(unsigned short)0x0002 && current<=(unsigned short)0xFFF6)) return 0;
+    uint32_t current = fatum_first_cluster(vol,file);
+    if(!(fatum_valid_cluster(vol,current))) return 0;
     uint32_t wait=file->file_size;
     uint32_t cluster_size=br.bytes_per_sector*br.sectors_per_cluster;
     char *p;
     while(1) {
-        if(current>=(unsigned short)0x0002 && current<=(unsigned short)0xFFF6) {
-            p=data+JMP_CLUSTER(current);
+        if(fatum_valid_cluster(vol,current)) {
+            p=fatum_cluster_ptr(vol,current);
             if(wait>cluster_size) {
                 for(int i=0; i<cluster_size; i++) printf("%c",*(p+i));
                 wait-=cluster_size;
             }
             else for(int i=0; i<wait; i++) printf("%c",*(p+i));
         }
-        else if(current==(unsigned short)0xFFF7) {
+        else if(current==vol->bad) {
             printf("\nCluster corrupted\n");
             return -4;
         }
-        else if(current>=(unsigned short)0xFFF8) break;
-        current=get_fat_index(current,fats[0]);
+        else if(current>=vol->eoc) break;
+        current=get_fat_index(current,vol->fat);
+    }
+    return 0;
+}
+
+char *parse_num_option(char *args, uint32_t *value) {
+    if(args[2]!=' ') return NULL;
+    char *end;
+    unsigned long v = strtoul(args+3,&end,10);
+    if(end==args+3 || *end!=' ' || v>UINT32_MAX) return NULL;
+    *value = v;
+    return end+1;
+}
+
+int print_open_range(fatum_file_t *f, uint32_t offset, uint32_t len) {
+    char *buffer = malloc(vol->cluster_size);
+    if(buffer==NULL) return -5;
+    ssize_t got;
+    while(len>0 && (got=fatum_pread(f,buffer,len<vol->cluster_size?len:vol->cluster_size,offset))>0) {
+        fwrite(buffer,sizeof(char),got,stdout);
+        offset+=got;
+        len-=got;
     }
+    free(buffer);
     return 0;
 }
 
+int print_file_range(entry_data_t *file, uint32_t offset, uint32_t len) {
+    fatum_file_t *f;
+    int status = fatum_fopen_entry(vol,file,&f);
+    if(status) return status;
+    status = print_open_range(f,offset,len);
+    fatum_fclose(f);
+    return status;
+}
+
+int print_file_head(entry_data_t *file, uint32_t lines) {
+    fatum_file_t *f;
+    int status = fatum_fopen_entry(vol,file,&f);
+    if(status) return status;
+    char *buffer = malloc(vol->cluster_size);
+    if(buffer==NULL) {
+        fatum_fclose(f);
+        return -5;
+    }
+    uint32_t offset=0;
+    ssize_t got;
+    while(lines>0 && (got=fatum_pread(f,buffer,vol->cluster_size,offset))>0) {
+        char *p=buffer;
+        while(lines>0 && (p=memchr(p,'\n',buffer+got-p))!=NULL) {
+            p++;
+            lines--;
+        }
+        fwrite(buffer,sizeof(char),lines==0?p-buffer:got,stdout);
+        offset+=got;
+    }
+    free(buffer);
+    fatum_fclose(f);
+    return 0;
+}
+
+int print_file_tail(entry_data_t *file, uint32_t lines) {
+    fatum_file_t *f;
+    int status = fatum_fopen_entry(vol,file,&f);
+    if(status) return status;
+    if(lines==0) {
+        fatum_fclose(f);
+        return 0;
+    }
+    char *buffer = malloc(vol->cluster_size);
+    if(buffer==NULL) {
+        fatum_fclose(f);
+        return -5;
+    }
+    // Scan backwards cluster by cluster; newline closing the last line doesn't count
+    uint32_t size=file->file_size;
+    uint32_t start=0;
+    uint32_t pos=size;
+    uint32_t found=0;
+    while(pos>0 && found<lines) {
+        uint32_t chunk = pos<vol->cluster_size?pos:vol->cluster_size;
+        pos-=chunk;
+        if(fatum_pread(f,buffer,chunk,pos)!=chunk) {
+            free(buffer);
+            fatum_fclose(f);
+            return -4;
+        }
+        for (uint32_t i=chunk; i>0; i--) {
+            if(buffer[i-1]=='\n' && pos+i!=size) {
+                found++;
+                if(found==lines) {
+                    start=pos+i;
+                    break;
+                }
+            }
+        }
+    }
+    free(buffer);
+    // Reuses the extents built above instead of walking the chain again
+    status = print_open_range(f,start,size-start);
+    fatum_fclose(f);
+    return status;
+}
+
 int get_file_contents(entry_data_t *file) {
     if(file==NULL) return -1;
     if(file->filename[0]==FEI_UNALLOC || file->filename[0]==FEI_DELETED) return -2;
     if(file->attributes==FAF_DIR) return -3;
-    unsigned short current = file->low_order_address_bytes;
-    if(!(current>=(unsigned short)0x0002 && current<=(unsigned short)0xFFF6)) return 0;
+    uint32_t current = fatum_first_cluster(vol,file);
+    if(!(fatum_valid_cluster(vol,current))) return 0;
     FILE *f;
     char formatted[13];
-    format_filename(file->filename,formatted);
+    fatum_format_filename(file->filename,formatted);
     f = fopen(formatted,"wb");
     if(f==NULL) {
         return -5;
@@ -550,21 +735,21 @@ int get_file_contents(entry_data_t *file) {
     uint32_t cluster_size=br.bytes_per_sector*br.sectors_per_cluster;
     char *p;
     while(1) {
-        if(current>=(unsigned short)0x0002 && current<=(unsigned short)0xFFF6) {
-            p=data+JMP_CLUSTER(current);
+        if(fatum_valid_cluster(vol,current)) {
+            p=fatum_cluster_ptr(vol,current);
             if(wait>cluster_size) {
                 fwrite(p,sizeof(char),cluster_size,f);
                 wait-=cluster_size;
             }
             else fwrite(p,sizeof(char),wait,f);
         }
-        else if(current==(unsigned short)0xFFF7) {
+        else if(current==vol->bad) {
             printf("\nCluster corrupted\n");
             fclose(f);
             return -4;
         }
-        else if(current>=(unsigned short)0xFFF8) break;
-        current=get_fat_index(current,fats[0]);
+        else if(current>=vol->eoc) break;
+        current=get_fat_index(current,vol->fat);
     }
     fclose(f);
     return 0;
@@ -574,11 +759,11 @@ int zip_file_contents(entry_data_t *file1, entry_data_t *file2, const char *outf
     if(file1==NULL || file2==NULL || outfile==NULL) return -1;
     if(file1->filename[0]==FEI_UNALLOC || file1->filename[0]==FEI_DELETED || file2->filename[0]==FEI_UNALLOC || file2->filename[0]==FEI_DELETED) return -2;
     if(file1->attributes==FAF_DIR || file2->attributes==FAF_DIR) return -3;
-    unsigned short current[2];
-    current[0]=file1->low_order_address_bytes;
-    current[1]=file2->low_order_address_bytes;
-    if(!(current[0]>=(unsigned short)0x0002 && current[0]<=(unsigned short)0xFFF6)) return 0;
-    if(!(current[1]>=(unsigned short)0x0002 && current[1]<=(unsigned short)0xFFF6)) return 0;
+    uint32_t current[2];
+    current[0]=fatum_first_cluster(vol,file1);
+    current[1]=fatum_first_cluster(vol,file2);
+    if(!(fatum_valid_cluster(vol,current[0]))) return 0;
+    if(!(fatum_valid_cluster(vol,current[1]))) return 0;
     FILE *f;
     f = fopen(outfile,"wb");
     if(f==NULL) return -5;
@@ -594,9 +779,9 @@ int zip_file_contents(entry_data_t *file1, entry_data_t *file2, const char *outf
     while(1) {
         for (int i=0; i<2; i++) {
             if(wait[i]>0 && !skip[i]) {
-                if(current[i]>=(unsigned short)0x0002 && current[i]<=(unsigned short)0xFFF6) {
+                if(fatum_valid_cluster(vol,current[i])) {
                     if(pos[i]==NULL) {
-                        pos[i]=data+JMP_CLUSTER(current[i]);
+                        pos[i]=fatum_cluster_ptr(vol,current[i]);
                         cluster_wait[i]=cluster_size;
                     }
                     next[i]=strchr(pos[i],'\n');
@@ -614,7 +799,7 @@ int zip_file_contents(entry_data_t *file1, entry_data_t *file2, const char *outf
                             fwrite(pos[i],sizeof(char),wait[i],f);
                             wait[i]=0;
                         }
-                        current[i]=get_fat_index(current[i],fats[0]);
+                        current[i]=get_fat_index(current[i],vol->fat);
                         pos[i]=NULL;
                         if(i==0) skip[1]=1;
                         else skip[0]=1;
@@ -630,12 +815,12 @@ int zip_file_contents(entry_data_t *file1, entry_data_t *file2, const char *outf
                         else skip[0]=0;
                     }
                 }
-                else if(current[i]==(unsigned short)0xFFF7) {
+                else if(current[i]==vol->bad) {
                     printf("\nCluster corrupted\n");
                     fclose(f);
                     return -4;
                 }
-                else if(current[i]>=(unsigned short)0xFFF8) wait[i]=0; 
+                else if(current[i]>=vol->eoc) wait[i]=0; 
             }
         }
         if(wait[0]<=0 && wait[1]<=0) break;
@@ -645,42 +830,36 @@ int zip_file_contents(entry_data_t *file1, entry_data_t *file2, const char *outf
 }
 
 void print_root_info() {
-    entry_data_t *current = root;
+    fatum_dir_t *dir;
+    if(fatum_opendir_entry(vol,NULL,&dir)) return;
     int entries=0;
-    while(current->filename[0]!=FEI_UNALLOC) {
-        if(hidden_in_dir(current,1)==0) {
-            entries++;
-        }
-        current=(entry_data_t*)((char*)current+sizeof(entry_data_t));
-    }
+    while(fatum_readdir(dir,NULL,NULL)) entries++;
+    fatum_closedir(dir);
     printf("Entries in the root directory: %d\n", entries);
+    if(vol->root_cluster) {
+        printf("Max entries: no limit (FAT32)\n");
+        return;
+    }
     printf("Max entries: %hu\n",br.max_files_in_root);
-    printf("Used percentage: %d%%\n",(entries/br.max_files_in_root)*100);
+    printf("Used percentage: %d%%\n",br.max_files_in_root?entries*100/br.max_files_in_root:0);
 }
 
-void print_space_info() {
-    uint32_t fat_entries=(br.size_of_fat*br.bytes_per_sector)/4;
-    unsigned short *entry=(unsigned short *)fats[0];
-
-    int used_entries=0;
-    int free_entries=0;
-    int crpt_entries=0;
-    int last_entries=0;
-
-    for (int i=0; i<fat_entries; i++) {
-        if(*entry>=(unsigned short)0x0002 && *entry<=(unsigned short)0xFFF6) used_entries++;
-        else if (*entry==(unsigned short)0x0000) free_entries++;
-        else if (*entry==(unsigned short)0xFFF7) crpt_entries++;
-        else if (*entry>=(unsigned short)0xFFF8) last_entries++;
-        entry++;
+void print_space_info(char full_scan) {
+    fatum_space_t space;
+    fatum_space(vol,&space,!full_scan);
+    if(space.hinted) {
+        printf("Used clusters (with ending and corrupted): %u\n",space.used);
+        printf("Free clusters: %u (FSInfo, spaceinfo -f scans the FAT)\n",space.free);
+    }
+    else {
+        printf("Used clusters: %u\n",space.used);
+        printf("Free clusters: %u\n",space.free);
+        printf("Corrupted clusters: %u\n",space.bad);
+        printf("Ending clusters: %u\n",space.last);
     }
-
-    printf("Used clusters: %d\n",used_entries);
-    printf("Free clusters: %d\n",free_entries);
-    printf("Corrupted clusters: %d\n",crpt_entries);
-    printf("Ending clusters: %d\n",last_entries);
     printf("Cluster size in bytes: %d\n",br.sectors_per_cluster*br.bytes_per_sector);
     printf("Cluster size in sectors: %d\n",br.sectors_per_cluster);
+    printf("FAT type: FAT%d\n",vol->fat_type);
 }
 
 void print_file_info(entry_data_t *f) {
@@ -688,13 +867,13 @@ void print_file_info(entry_data_t *f) {
     printf("File path: \\");
     for (int i=0; i<history.size; i++) printf("%s\\",history.dirs[i]);
     char formatted[13];
-    format_filename(f->filename,formatted);
+    fatum_format_filename(f->filename,formatted);
     printf("%s\n",formatted);
-    filedate_t cd = get_date(f->creation_date);
-    filedate_t ad = get_date(f->access_date);
-    filedate_t md = get_date(f->modified_date);
-    filetime_t ct = get_time(f->creation_time);
-    filetime_t mt = get_time(f->modified_time);
+    filedate_t cd = fatum_get_date(f->creation_date);
+    filedate_t ad = fatum_get_date(f->access_date);
+    filedate_t md = fatum_get_date(f->modified_date);
+    filetime_t ct = fatum_get_time(f->creation_time);
+    filetime_t mt = fatum_get_time(f->modified_time);
     
     printf("Attributes: ");
     (f->attributes & FAF_ARCHIVE)?printf("A+ "):printf("A- ");
@@ -709,24 +888,646 @@ void print_file_info(entry_data_t *f) {
     printf("Last access: %02d/%02d/%04d\n",ad.day,ad.month,ad.year);
     printf("Created: %02d/%02d/%04d %02d:%02d\n",cd.day,cd.month,cd.year,ct.hrs,ct.min);
     printf("Clusters chain: ");
-    unsigned short cluster = f->low_order_address_bytes;
-    int clusters=0;
-    while(cluster>=(unsigned short)0x0002 && cluster<=(unsigned short)0xFFF6) {
-        printf("%hu ",cluster);
-        cluster=get_fat_index(cluster,fats[0]);
+    uint32_t cluster = fatum_first_cluster(vol,f);
+    uint32_t clusters=0;
+    while(fatum_valid_cluster(vol,cluster) && clusters<=vol->cluster_count) {
+        printf("%u ",cluster);
+        cluster=get_fat_index(cluster,vol->fat);
         clusters++;
     }
-    printf("\nClusters count: %d\n",clusters);
+    printf("\nClusters count: %u\n",clusters);
+}
+
+// First occurrence of pat in hay; memchr does the vectorized scan for candidates
+const char *find_pattern(const char *hay, size_t n, const char *pat, size_t m) {
+    if(m==0 || m>n) return NULL;
+    const char *last = hay+n-m;
+    const char *p = hay;
+    while(p<=last && (p=memchr(p,pat[0],last-p+1))!=NULL) {
+        if(p[m-1]==pat[m-1] && !memcmp(p,pat,m)) return p;
+        p++;
+    }
+    return NULL;
+}
+
+int grep_append(grep_job_t *job, const char *text, size_t len) {
+    if(job->output_size+len>job->output_cap) {
+        size_t cap = job->output_cap ? job->output_cap : 256;
+        while(cap<job->output_size+len) cap*=2;
+        char *grown = realloc(job->output,cap);
+        if(grown==NULL) return -5;
+        job->output = grown;
+        job->output_cap = cap;
+    }
+    memcpy(job->output+job->output_size,text,len);
+    job->output_size+=len;
+    return 0;
+}
+
+void grep_match_line(grep_job_t *job, uint32_t line_no, const char *start, const char *stop, int *status) {
+    char header[16];
+    int len = snprintf(header,sizeof(header),":%u:",line_no);
+    if(grep_append(job,job->path,strlen(job->path)) || grep_append(job,header,len) || grep_append(job,start,stop-start) || grep_append(job,"\n",1)) *status=-5;
+}
+
+// Reads the file in chunks; a partial last line is carried over to the next chunk,
+// so matches spanning cluster boundaries are found like any other
+int grep_file(grep_job_t *job, const char *pattern, char **buffer, size_t *buffer_size) {
+    fatum_file_t *f;
+    int status = fatum_fopen_entry(vol,job->entry,&f);
+    if(status) return status;
+    size_t m = strlen(pattern);
+    size_t carry = 0;
+    size_t end;
+    uint32_t offset = 0;
+    uint32_t line_no = 1;
+    char binary = 0;
+    while(status==0) {
+        char *buf = *buffer;
+        ssize_t got = fatum_pread(f,buf+carry,*buffer_size-carry,offset);
+        if(got<0) got = 0;
+        size_t total = carry+got;
+        if(offset==0 && memchr(buf,'\0',total)) binary = 1;
+        offset+=got;
+        char eof = got==0 || offset>=job->entry->file_size;
+        if(binary) {
+            // Binary files are reported once, the way grep does it
+            if(find_pattern(buf,total,pattern,m)) {
+                if(grep_append(job,"Binary file ",12) || grep_append(job,job->path,strlen(job->path)) || grep_append(job," matches\n",9)) status=-5;
+                break;
+            }
+            if(eof) break;
+            end = total>m-1 ? total-(m-1) : 0;
+        }
+        else {
+            end = total;
+            if(!eof) while(end>0 && buf[end-1]!='\n') end--;
+            const char *limit = buf+end;
+            const char *counted = buf;
+            const char *p = buf;
+            const char *match;
+            while(status==0 && (match=find_pattern(p,limit-p,pattern,m))!=NULL) {
+                const char *start = match;
+                while(start>p && start[-1]!='\n') start--;
+                for (const char *c=counted; (c=memchr(c,'\n',start-c))!=NULL; c++) line_no++;
+                const char *stop = memchr(match,'\n',limit-match);
+                if(stop==NULL) stop = limit;
+                grep_match_line(job,line_no,start,stop,&status);
+                counted = start;
+                p = stop<limit ? stop+1 : limit;
+            }
+            for (const char *c=counted; (c=memchr(c,'\n',limit-c))!=NULL; c++) line_no++;
+            if(eof) break;
+        }
+        carry = total-end;
+        memmove(buf,buf+end,carry);
+        if(carry==*buffer_size) {
+            // Single line longer than the buffer
+            char *grown = realloc(buf,*buffer_size*2);
+            if(grown==NULL) status=-5;
+            else {
+                *buffer = grown;
+                *buffer_size*=2;
+            }
+        }
+    }
+    fatum_fclose(f);
+    return status;
+}
+
+void *grep_worker(void *arg) {
+    grep_task_t *task = arg;
+    size_t buffer_size = 64*1024;
+    char *buffer = malloc(buffer_size);
+    if(buffer==NULL) {
+        pthread_mutex_lock(&task->lock);
+        task->status = -5;
+        pthread_mutex_unlock(&task->lock);
+        return NULL;
+    }
+    while(1) {
+        pthread_mutex_lock(&task->lock);
+        size_t i = task->next++;
+        pthread_mutex_unlock(&task->lock);
+        if(i>=task->count) break;
+        grep_job_t *job = &task->jobs[i];
+        int status = grep_file(job,task->pattern,&buffer,&buffer_size);
+        if(status==-4) {
+            grep_append(job,job->path,strlen(job->path));
+            grep_append(job,": Cluster corrupted\n",20);
+        }
+        else if(status==-5) {
+            pthread_mutex_lock(&task->lock);
+            task->status = -5;
+            pthread_mutex_unlock(&task->lock);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+int add_grep_job(grep_task_t *task, entry_data_t *entry, char *path, size_t *capacity) {
+    if(task->count==*capacity) {
+        size_t cap = *capacity ? *capacity*2 : 64;
+        grep_job_t *grown = realloc(task->jobs,cap*sizeof(grep_job_t));
+        if(grown==NULL) return -5;
+        task->jobs = grown;
+        *capacity = cap;
+    }
+    grep_job_t *job = &task->jobs[task->count++];
+    memset(job,0,sizeof(grep_job_t));
+    job->entry = entry;
+    job->path = path;
+    return 0;
+}
+
+int collect_grep_jobs(grep_task_t *task, entry_data_t *dir, const char *prefix, char recursive, size_t *capacity, uint32_t depth) {
+    fatum_dir_t *d;
+    int status = fatum_opendir_entry(vol,dir,&d);
+    if(status) return status;
+    fatum_stat_t st;
+    entry_data_t *entry;
+    while(status==0 && fatum_readdir(d,&st,&entry)) {
+        size_t len = strlen(prefix)+strlen(st.name)+2;
+        char *path = malloc(len);
+        if(path==NULL) {
+            status = -5;
+            break;
+        }
+        if(prefix[0]) snprintf(path,len,"%s\\%s",prefix,st.name);
+        else strcpy(path,st.name);
+        if(st.attributes & FAF_DIR) {
+            if(recursive && depth<FATUM_MAX_DEPTH) status = collect_grep_jobs(task,entry,path,recursive,capacity,depth+1);
+            free(path);
+            if(status==-4) status = 0;
+            continue;
+        }
+        status = add_grep_job(task,entry,path,capacity);
+        if(status) free(path);
+    }
+    fatum_closedir(d);
+    return status;
+}
+
+int grep_entries(entry_data_t *target, const char *path, const char *pattern, char recursive) {
+    grep_task_t task;
+    memset(&task,0,sizeof(grep_task_t));
+    task.pattern = pattern;
+    size_t capacity = 0;
+    int status;
+    if(target && !(target->attributes & FAF_DIR)) {
+        char *name = strdup(path);
+        if(name==NULL) return -5;
+        status = add_grep_job(&task,target,name,&capacity);
+        if(status) free(name);
+    }
+    else status = collect_grep_jobs(&task,target,path?path:"",recursive,&capacity,0);
+
+    if(status==0 && task.count>0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t workers = cpus>0 ? cpus : 1;
+        if(workers>GREP_MAX_WORKERS) workers = GREP_MAX_WORKERS;
+        if(workers>task.count) workers = task.count;
+        pthread_t threads[GREP_MAX_WORKERS];
+        pthread_mutex_init(&task.lock,NULL);
+        size_t started = 0;
+        for (; started<workers; started++) {
+            if(pthread_create(&threads[started],NULL,grep_worker,&task)) break;
+        }
+        if(started==0) grep_worker(&task);
+        for (size_t i=0; i<started; i++) pthread_join(threads[i],NULL);
+        pthread_mutex_destroy(&task.lock);
+        status = task.status;
+        for (size_t i=0; i<task.count; i++) {
+            if(task.jobs[i].output_size) fwrite(task.jobs[i].output,sizeof(char),task.jobs[i].output_size,stdout);
+        }
+    }
+    for (size_t i=0; i<task.count; i++) {
+        free(task.jobs[i].path);
+        free(task.jobs[i].output);
+    }
+    free(task.jobs);
+    return status;
+}
+
+int writer_put(writer_t *w, const char *text, size_t len) {
+    if(w->used+len>w->size) {
+        if(writer_flush(w)) return -6;
+        if(len>w->size) {
+            if(fwrite(text,sizeof(char),len,w->out)!=len) return -6;
+            return 0;
+        }
+    }
+    memcpy(w->buf+w->used,text,len);
+    w->used+=len;
+    return 0;
+}
+
+int writer_flush(writer_t *w) {
+    if(w->used && fwrite(w->buf,sizeof(char),w->used,w->out)!=w->used) return -6;
+    w->used = 0;
+    return 0;
+}
+
+void chain_summary(uint32_t cluster, uint32_t *clusters, uint32_t *fragments) {
+    *clusters = 0;
+    *fragments = 0;
+    uint32_t previous = 0;
+    while(fatum_valid_cluster(vol,cluster) && *clusters<=vol->cluster_count) {
+        if(cluster!=previous+1) (*fragments)++;
+        (*clusters)++;
+        previous = cluster;
+        cluster = fatum_next_cluster(vol,cluster);
+    }
 }
 
-int main() {
+// Appends text to dst as a JSON string body (or CSV field body), returns new length
+size_t escape_field(char *dst, size_t pos, size_t cap, const char *text, char csv) {
+    for (; *text && pos+7<cap; text++) {
+        unsigned char c = *text;
+        if(csv) {
+            if(c=='"') dst[pos++]='"';
+            dst[pos++]=c;
+        }
+        else if(c=='"' || c=='\\') {
+            dst[pos++]='\\';
+            dst[pos++]=c;
+        }
+        else if(c<0x20) pos+=sprintf(dst+pos,"\\u%04x",c);
+        else dst[pos++]=c;
+    }
+    dst[pos]='\0';
+    return pos;
+}
+
+int export_entry(writer_t *w, const char *path, fatum_stat_t *st, char csv) {
+    char attrs[7];
+    int a=0;
+    if(st->attributes & FAF_ARCHIVE) attrs[a++]='A';
+    if(st->attributes & FAF_READ_ONLY) attrs[a++]='R';
+    if(st->attributes & FAF_SYSTEM_FILE) attrs[a++]='S';
+    if(st->attributes & FAF_HIDDEN_FILE) attrs[a++]='H';
+    if(st->attributes & FAF_DIR) attrs[a++]='D';
+    if(st->attributes & FAF_VOL_LABEL) attrs[a++]='V';
+    attrs[a]='\0';
+    uint32_t clusters;
+    uint32_t fragments;
+    chain_summary(st->first_cluster,&clusters,&fragments);
+
+    char record[EXPORT_PATH_MAX*2+512];
+    size_t len;
+    if(csv) {
+        record[0]='"';
+        len = escape_field(record,1,EXPORT_PATH_MAX*2,path,1);
+        record[len++]='"';
+    }
+    else {
+        len = sprintf(record,"{\"path\":\"");
+        len = escape_field(record,len,EXPORT_PATH_MAX*2,path,0);
+    }
+    const char *fmt = csv ?
+        ",%u,%s,%s,%04d-%02d-%02dT%02d:%02d:%02d,%04d-%02d-%02dT%02d:%02d:%02d,%04d-%02d-%02d,%u,%u,%u\n" :
+        "\",\"size\":%u,\"attributes\":\"%s\",\"type\":\"%s\",\"modified\":\"%04d-%02d-%02dT%02d:%02d:%02d\",\"created\":\"%04d-%02d-%02dT%02d:%02d:%02d\",\"accessed\":\"%04d-%02d-%02d\",\"first_cluster\":%u,\"clusters\":%u,\"fragments\":%u}\n";
+    len += snprintf(record+len,sizeof(record)-len,fmt,st->size,attrs,(st->attributes & FAF_DIR)?"dir":"file",
+        st->modified_date.year,st->modified_date.month,st->modified_date.day,st->modified_time.hrs,st->modified_time.min,st->modified_time.sec,
+        st->created_date.year,st->created_date.month,st->created_date.day,st->created_time.hrs,st->created_time.min,st->created_time.sec,
+        st->access_date.year,st->access_date.month,st->access_date.day,
+        st->first_cluster,clusters,fragments);
+    return writer_put(w,record,len);
+}
+
+int export_dir(writer_t *w, entry_data_t *dir, char *path, size_t path_len, char csv, uint32_t *count, uint32_t *skipped) {
+    fatum_dir_t *d;
+    if(fatum_opendir_entry(vol,dir,&d)) {
+        fprintf(stderr,"%s: directory can't be read, skipped\n",path_len ? path : "\\");
+        (*skipped)++;
+        return 0;
+    }
+    fatum_stat_t st;
+    entry_data_t *entry;
+    int status = 0;
+    while(status==0 && fatum_readdir(d,&st,&entry)) {
+        size_t name_len = strlen(st.name);
+        // Deeper paths can only come from a looped directory chain
+        if(path_len+name_len+2>EXPORT_PATH_MAX) {
+            fprintf(stderr,"%.*s\\%s: path too long, skipped\n",(int)path_len,path,st.name);
+            (*skipped)++;
+            continue;
+        }
+        path[path_len]='\\';
+        memcpy(path+path_len+1,st.name,name_len+1);
+        status = export_entry(w,path,&st,csv);
+        (*count)++;
+        if(status==0 && (st.attributes & FAF_DIR)) status = export_dir(w,entry,path,path_len+1+name_len,csv,count,skipped);
+    }
+    path[path_len]='\0';
+    fatum_closedir(d);
+    return status;
+}
+
+int export_manifest(char csv, const char *outfile) {
+    writer_t w;
+    w.out = stdout;
+    if(outfile) {
+        w.out = fopen(outfile,"wb");
+        if(w.out==NULL) return -5;
+    }
+    w.size = EXPORT_BUFFER_SIZE;
+    w.used = 0;
+    w.buf = malloc(w.size);
+    if(w.buf==NULL) {
+        if(outfile) fclose(w.out);
+        return -5;
+    }
+    char path[EXPORT_PATH_MAX];
+    path[0]='\0';
+    uint32_t count = 0;
+    uint32_t skipped = 0;
+    int status = 0;
+    if(csv) {
+        const char *header = "path,size,attributes,type,modified,created,accessed,first_cluster,clusters,fragments\n";
+        status = writer_put(&w,header,strlen(header));
+    }
+    if(status==0) status = export_dir(&w,NULL,path,0,csv,&count,&skipped);
+    if(status==0) status = writer_flush(&w);
+    fflush(w.out);
+    if(outfile && fclose(w.out)) status = -6;
+    free(w.buf);
+    if(status==0 && outfile) printf("Exported %u entries to %s, %u skipped\n",count,outfile,skipped);
+    else if(status==0 && skipped) fprintf(stderr,"%u entries skipped\n",skipped);
+    return status;
+}
+
+uint8_t attribute_flag(char letter) {
+    switch(toupper(letter)) {
+        case 'A': return FAF_ARCHIVE;
+        case 'R': return FAF_READ_ONLY;
+        case 'S': return FAF_SYSTEM_FILE;
+        case 'H': return FAF_HIDDEN_FILE;
+        case 'D': return FAF_DIR;
+        case 'V': return FAF_VOL_LABEL;
+    }
+    return 0;
+}
+
+int parse_query_arg(const char *arg, fatum_query_t *q) {
+    if(arg[0]=='+' || arg[0]=='-') {
+        if(arg[1]=='\0') return -1;
+        for (const char *c=arg+1; *c; c++) {
+            uint8_t flag = attribute_flag(*c);
+            if(flag==0) return -1;
+            if(arg[0]=='+') q->attr_set|=flag;
+            else q->attr_clear|=flag;
+        }
+        return 0;
+    }
+    if(!strncmp(arg,"size",4) && (arg[4]=='>' || arg[4]=='<')) {
+        char *end;
+        unsigned long v = strtoul(arg+5,&end,10);
+        if(end==arg+5 || *end!='\0' || v>UINT32_MAX) return -1;
+        // Bounds are inclusive; size>MAX and size<0 give an empty range
+        if((arg[4]=='>' && v==UINT32_MAX) || (arg[4]=='<' && v==0)) {
+            q->min_size = 1;
+            q->max_size = 0;
+        }
+        else if(arg[4]=='>' && v+1>q->min_size) q->min_size = v+1;
+        else if(arg[4]=='<' && v-1<q->max_size) q->max_size = v-1;
+        return 0;
+    }
+    if(!strncmp(arg,"mtime",5) && (arg[5]=='>' || arg[5]=='<')) {
+        int y, mo, d, h=0, mi=0, n=0;
+        if(sscanf(arg+6,"%d-%d-%d%n",&y,&mo,&d,&n)!=3) return -1;
+        if(arg[6+n]=='T') {
+            int m=0;
+            if(sscanf(arg+6+n,"T%d:%d%n",&h,&mi,&m)!=2) return -1;
+            n+=m;
+        }
+        if(arg[6+n]!='\0' || y<1980 || y>2107 || mo<1 || mo>12 || d<1 || d>31 || h<0 || h>23 || mi<0 || mi>59) return -1;
+        short date = ((y-1980)<<SHIFT_YEAR)|(mo<<SHIFT_MONTH)|d;
+        short time = (h<<SHIFT_HOUR)|(mi<<SHIFT_MIN);
+        uint32_t key = fatum_timestamp(date,time);
+        if(arg[5]=='>' && key+1>q->modified_from) q->modified_from = key+1;
+        if(arg[5]=='<' && key-1<q->modified_to) q->modified_to = key-1;
+        return 0;
+    }
+    return -1;
+}
+
+int run_query(const fatum_query_t *q) {
+    struct timespec start, stop;
+    if(table==NULL) {
+        int status = fatum_table_build(vol,&table);
+        if(status) return status;
+    }
+    uint8_t *mask = malloc(table->count ? table->count : 1);
+    if(mask==NULL) return -5;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    size_t matches = fatum_table_filter(table,q,mask);
+    clock_gettime(CLOCK_MONOTONIC,&stop);
+    char path[EXPORT_PATH_MAX];
+    for (size_t i=0; i<table->count; i++) {
+        if(!mask[i]) continue;
+        filedate_t md = fatum_get_date(table->modified[i]>>16);
+        filetime_t mt = fatum_get_time(table->modified[i]&0xFFFF);
+        if(!fatum_table_path(table,i,path,sizeof(path))) strcpy(path,table->name[i]);
+        printf("%02d/%02d/%04d %02d:%02d ",md.day,md.month,md.year,mt.hrs,mt.min);
+        if(table->attributes[i]==FAF_DIR) printf("%-12s ","<DIR>");
+        else printf("%10u B ",table->size[i]);
+        printf("%s\n",path);
+    }
+    double ms = (stop.tv_sec-start.tv_sec)*1000.0+(stop.tv_nsec-start.tv_nsec)/1000000.0;
+    printf("%zu of %zu entries matched (%.3f ms)\n",matches,table->count,ms);
+    free(mask);
+    return 0;
+}
+
+int write_fd(int fd, const char *buf, size_t len) {
+    while(len>0) {
+        ssize_t n = write(fd,buf,len);
+        if(n<0) {
+            if(errno==EINTR) continue;
+            return -6;
+        }
+        buf+=n;
+        len-=n;
+    }
+    return 0;
+}
+
+// ustar header; FAT times have no time zone, so they're stored as if they were UTC
+int tar_header(int fd, const char *path, fatum_stat_t *st) {
+    char block[TAR_BLOCK];
+    memset(block,0,TAR_BLOCK);
+    char dir = (st->attributes & FAF_DIR)!=0;
+    size_t len = strlen(path);
+    const char *name = path;
+    if(len>100) {
+        // Split into prefix and name at a '/'
+        const char *split = path+len-100;
+        while(*split && *split!='/') split++;
+        if(*split=='\0' || split-path>155) return -7;
+        memcpy(block+345,path,split-path);
+        name = split+1;
+    }
+    memcpy(block,name,strlen(name));
+    int mode = dir ? 0755 : 0644;
+    if(st->attributes & FAF_READ_ONLY) mode &= ~0222;
+    struct tm tm;
+    memset(&tm,0,sizeof(tm));
+    tm.tm_year = st->modified_date.year-1900;
+    tm.tm_mon = st->modified_date.month-1;
+    tm.tm_mday = st->modified_date.day;
+    tm.tm_hour = st->modified_time.hrs;
+    tm.tm_min = st->modified_time.min;
+    tm.tm_sec = st->modified_time.sec;
+    time_t mtime = timegm(&tm);
+    if(mtime<0) mtime = 0;
+    sprintf(block+100,"%07o",mode);
+    sprintf(block+108,"%07o",0);
+    sprintf(block+116,"%07o",0);
+    sprintf(block+124,"%011o",dir ? 0 : st->size);
+    sprintf(block+136,"%011lo",(unsigned long)mtime);
+    block[156] = dir ? '5' : '0';
+    memcpy(block+257,"ustar",6);
+    memcpy(block+263,"00",2);
+    memset(block+148,' ',8);
+    unsigned int sum = 0;
+    for (int i=0; i<TAR_BLOCK; i++) sum += (unsigned char)block[i];
+    sprintf(block+148,"%06o",sum);
+    block[155] = ' ';
+    return write_fd(fd,block,TAR_BLOCK);
+}
+
+int tar_entry(int fd, const char *path, fatum_stat_t *st, entry_data_t *entry) {
+    int status = tar_header(fd,path,st);
+    if(status || (st->attributes & FAF_DIR)) return status;
+    static const char zeros[TAR_BLOCK];
+    uint32_t written = 0;
+    fatum_file_t *f;
+    if(fatum_fopen_entry(vol,entry,&f)==0) {
+        ssize_t sent = fatum_sendfile(f,fd);
+        fatum_fclose(f);
+        if(sent==-6) return -6;
+        if(sent>0) written = sent;
+    }
+    if(written<st->size) {
+        // Header is already out, so a broken chain is archived as zeros
+        for (uint32_t left=st->size-written; left>0 && status==0; ) {
+            uint32_t n = left<TAR_BLOCK ? left : TAR_BLOCK;
+            status = write_fd(fd,zeros,n);
+            left-=n;
+        }
+        fprintf(stderr,"%s: cluster corrupted\n",path);
+    }
+    uint32_t pad = (TAR_BLOCK-st->size%TAR_BLOCK)%TAR_BLOCK;
+    if(status==0 && pad) status = write_fd(fd,zeros,pad);
+    return status;
+}
+
+int tar_dir(int fd, entry_data_t *dir, char *path, size_t path_len, uint32_t depth) {
+    fatum_dir_t *d;
+    if(fatum_opendir_entry(vol,dir,&d)) return 0;
+    fatum_stat_t st;
+    entry_data_t *entry;
+    int status = 0;
+    while(status==0 && fatum_readdir(d,&st,&entry)) {
+        size_t name_len = strlen(st.name);
+        char is_dir = (st.attributes & FAF_DIR)!=0;
+        if(path_len+name_len+2>TAR_PATH_MAX) {
+            fprintf(stderr,"%.*s/%s: path too long, skipped\n",(int)path_len,path,st.name);
+            continue;
+        }
+        memcpy(path+path_len,st.name,name_len);
+        size_t len = path_len+name_len;
+        if(is_dir) path[len++]='/';
+        path[len]='\0';
+        status = tar_entry(fd,path,&st,entry);
+        if(status==-7) {
+            fprintf(stderr,"%s: path too long, skipped\n",path);
+            status = 0;
+            continue;
+        }
+        if(status==0 && is_dir && depth<FATUM_MAX_DEPTH) status = tar_dir(fd,entry,path,len,depth+1);
+    }
+    path[path_len]='\0';
+    fatum_closedir(d);
+    return status;
+}
+
+int tar_export(entry_data_t *dir, const char *outfile) {
+    int fd = STDOUT_FILENO;
+    fflush(stdout);
+    if(outfile) {
+        fd = open(outfile,O_WRONLY|O_CREAT|O_TRUNC,0644);
+        if(fd<0) return -5;
+    }
+    char path[TAR_PATH_MAX+1];
+    size_t len = 0;
+    int status = 0;
+    if(dir) {
+        fatum_stat_t st;
+        fatum_stat_entry(vol,dir,&st);
+        len = strlen(st.name);
+        memcpy(path,st.name,len);
+        path[len++]='/';
+        path[len]='\0';
+        // "." and ".." entries don't carry the directory's own name
+        if(st.name[0]!='.') status = tar_header(fd,path,&st);
+        else len = 0;
+    }
+    if(status==0) status = tar_dir(fd,dir,path,len,0);
+    if(status==0) {
+        static const char zeros[TAR_BLOCK*2];
+        status = write_fd(fd,zeros,sizeof(zeros));
+    }
+    if(outfile && close(fd)) status = -6;
+    return status;
+}
+
+int main(int argc, char **argv) {
+    if(argc>1 && !strcmp(argv[1],"-s")) {
+        if(argc<4) {
+            printf("syntax: %s -s socket-path image [image...]\n",argv[0]);
+            return 1;
+        }
+        return run_server(argv[2],argv+3,argc-3);
+    }
+    if(argc>1 && !strcmp(argv[1],"-c")) {
+        if(argc!=4) {
+            printf("syntax: %s -c socket-path \"image-index command [args]\"\n",argv[0]);
+            return 1;
+        }
+        return run_client(argv[2],argv[3]);
+    }
+    if(argc>1 && !strcmp(argv[1],"-z")) {
+        if(argc<4 || argc>5) {
+            printf("syntax: %s -z raw-image output [chunk-size]\n",argv[0]);
+            return 1;
+        }
+        unsigned long chunk_size = 0;
+        if(argc==5) {
+            char *end;
+            chunk_size = strtoul(argv[4],&end,10);
+            if(end==argv[4] || *end!='\0' || chunk_size<512 || chunk_size>FATUM_Z_CHUNK_MAX) {
+                printf("Chunk size must be between 512 and %d bytes\n",FATUM_Z_CHUNK_MAX);
+                return 1;
+            }
+        }
+        int ret = fatum_compress(argv[2],argv[3],chunk_size);
+        if(ret==-1) printf("Chunk size must be between 512 and %d bytes\n",FATUM_Z_CHUNK_MAX);
+        else if(ret==-2) printf("Can't read %s\n",argv[2]);
+        else if(ret==-5) printf("Can't allocate memory\n");
+        else if(ret==-6) printf("Can't write %s\n",argv[3]);
+        return ret ? 1 : 0;
+    }
 
-    strcpy(filename,"fat16.bin");
+    if(argc>1) strncpy(filename,argv[1],sizeof(filename)-1);
+    else strcpy(filename,"fat16.bin");
     int ret = load_disk();
     if(ret) return ret;
     history.dirs=NULL;
     history.size=0;
-    if(memcmp(fats[0],fats[1],br.size_of_fat*br.bytes_per_sector)) {
+    if(vol->mirrored && br.number_of_fats>1 && memcmp(fats[0],fats[1],vol->fat_bytes)) {
         prepare_for_exit();
         return -1;
     }
@@ -0,0 +1,1016 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "libfatum.h"
+#include "fat_layout.h"
+
+typedef struct chunk {
+    uint64_t index; // UINT64_MAX if the slot is empty
+    uint64_t used; // tick of the last use, the oldest slot is reused first
+    char *data;
+} chunk_t;
+
+typedef struct fatum_zimage {
+    int fd;
+    uint32_t chunk_size;
+    uint64_t image_size;
+    uint64_t chunk_count;
+    uint64_t *offsets;
+    char *compressed; // one stored chunk
+    size_t compressed_cap;
+    chunk_t cache[FATUM_Z_CACHE];
+    uint64_t tick;
+    pthread_mutex_t lock; // guards the cache and the volume's loaded bitmap
+} zimage_t;
+
+static void zimage_close(zimage_t *z) {
+    if(z==NULL) return;
+    if(z->fd>=0) close(z->fd);
+    free(z->offsets);
+    free(z->compressed);
+    for (int i=0; i<FATUM_Z_CACHE; i++) free(z->cache[i].data);
+    pthread_mutex_destroy(&z->lock);
+    free(z);
+}
+
+static int read_at(int fd, void *buf, size_t len, off_t pos) {
+    while(len>0) {
+        ssize_t n = pread(fd,buf,len,pos);
+        if(n<0 && errno==EINTR) continue;
+        if(n<=0) return -1;
+        buf = (char*)buf+n;
+        len-=n;
+        pos+=n;
+    }
+    return 0;
+}
+
+// Returns 0 with *z set, 1 if path isn't a compressed image, 2 read failure or bad header, 3 allocation failure
+static int zimage_open(const char *path, zimage_t **z) {
+    int fd = open(path,O_RDONLY);
+    if(fd<0) return 2;
+    fatum_zheader_t h;
+    if(read_at(fd,&h,sizeof(h),0) || memcmp(h.magic,FATUM_Z_MAGIC,sizeof(h.magic))) {
+        close(fd);
+        return 1;
+    }
+    if(h.chunk_size<512 || h.chunk_size>FATUM_Z_CHUNK_MAX || h.chunk_count!=(h.image_size+h.chunk_size-1)/h.chunk_size || h.chunk_count>=SIZE_MAX/sizeof(uint64_t)) {
+        close(fd);
+        return 2;
+    }
+    zimage_t *r = calloc(1,sizeof(zimage_t));
+    if(r==NULL) {
+        close(fd);
+        return 3;
+    }
+    r->fd = fd;
+    r->chunk_size = h.chunk_size;
+    r->image_size = h.image_size;
+    r->chunk_count = h.chunk_count;
+    pthread_mutex_init(&r->lock,NULL);
+    r->compressed_cap = compressBound(h.chunk_size);
+    r->offsets = malloc((h.chunk_count+1)*sizeof(uint64_t));
+    r->compressed = malloc(r->compressed_cap);
+    if(r->offsets==NULL || r->compressed==NULL) {
+        zimage_close(r);
+        return 3;
+    }
+    for (int i=0; i<FATUM_Z_CACHE; i++) {
+        r->cache[i].index = UINT64_MAX;
+        r->cache[i].data = malloc(h.chunk_size);
+        if(r->cache[i].data==NULL) {
+            zimage_close(r);
+            return 3;
+        }
+    }
+    if(read_at(fd,r->offsets,(h.chunk_count+1)*sizeof(uint64_t),sizeof(h))) {
+        zimage_close(r);
+        return 2;
+    }
+    *z = r;
+    return 0;
+}
+
+static uint32_t chunk_length(const zimage_t *z, uint64_t index) {
+    uint64_t left = z->image_size-index*z->chunk_size;
+    return left<z->chunk_size ? left : z->chunk_size;
+}
+
+// Decompressed chunk from the cache, loaded into the oldest slot on a miss. Caller holds the lock.
+static char *zimage_chunk(zimage_t *z, uint64_t index) {
+    chunk_t *slot = &z->cache[0];
+    for (int i=0; i<FATUM_Z_CACHE; i++) {
+        if(z->cache[i].index==index) {
+            z->cache[i].used = ++z->tick;
+            return z->cache[i].data;
+        }
+        if(z->cache[i].used<slot->used) slot = &z->cache[i];
+    }
+    uint32_t length = chunk_length(z,index);
+    uint64_t start = z->offsets[index], end = z->offsets[index+1];
+    if(end<start || end-start>z->compressed_cap) return NULL;
+    size_t stored = end-start;
+    slot->index = UINT64_MAX;
+    slot->used = 0;
+    if(stored==length) {
+        if(read_at(z->fd,slot->data,length,start)) return NULL;
+    }
+    else {
+        uLongf size = length;
+        if(read_at(z->fd,z->compressed,stored,start)) return NULL;
+        if(uncompress((Bytef*)slot->data,&size,(Bytef*)z->compressed,stored)!=Z_OK || size!=length) return NULL;
+    }
+    slot->index = index;
+    slot->used = ++z->tick;
+    return slot->data;
+}
+
+// Reads len bytes at offset of the uncompressed image. Caller holds the lock.
+static int zimage_read(zimage_t *z, void *buffer, uint64_t offset, size_t len) {
+    if(offset>z->image_size || len>z->image_size-offset) return -1;
+    while(len>0) {
+        uint64_t index = offset/z->chunk_size;
+        uint32_t in_chunk = offset%z->chunk_size;
+        char *chunk = zimage_chunk(z,index);
+        if(chunk==NULL) return -1;
+        size_t n = chunk_length(z,index)-in_chunk;
+        if(n>len) n = len;
+        memcpy(buffer,chunk+in_chunk,n);
+        buffer = (char*)buffer+n;
+        offset+=n;
+        len-=n;
+    }
+    return 0;
+}
+
+// Makes sure the clusters are in the data area, decompressing the missing ones
+static int load_clusters(const fatum_t *vol, uint32_t cluster, uint32_t count) {
+    zimage_t *z = vol->zimage;
+    int ret = 0;
+    pthread_mutex_lock(&z->lock);
+    for (uint32_t c=cluster-2; c<cluster-2+count && ret==0; c++) {
+        if(vol->loaded[c>>3]&(1<<(c&7))) continue;
+        uint64_t pos = (uint64_t)c*vol->cluster_size;
+        if(zimage_read(z,vol->data+pos,vol->data_offset+pos,vol->cluster_size)) ret = -4;
+        else vol->loaded[c>>3] |= 1<<(c&7);
+    }
+    pthread_mutex_unlock(&z->lock);
+    return ret;
+}
+
+int fatum_compress(const char *raw, const char *out, uint32_t chunk_size) {
+    if(raw==NULL || out==NULL || chunk_size>FATUM_Z_CHUNK_MAX || (chunk_size && chunk_size<512)) return -1;
+    if(chunk_size==0) chunk_size = FATUM_Z_CHUNK_SIZE;
+    FILE *in = fopen(raw,"rb");
+    if(in==NULL) return -2;
+    fatum_zheader_t h;
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,FATUM_Z_MAGIC,sizeof(h.magic));
+    h.chunk_size = chunk_size;
+    if(fseeko(in,0,SEEK_END) || ftello(in)<0) {
+        fclose(in);
+        return -2;
+    }
+    h.image_size = ftello(in);
+    h.chunk_count = (h.image_size+chunk_size-1)/chunk_size;
+    rewind(in);
+
+    uLong bound = compressBound(chunk_size);
+    char *chunk = malloc(chunk_size);
+    char *packed = malloc(bound);
+    uint64_t *offsets = calloc(h.chunk_count+1,sizeof(uint64_t));
+    FILE *f = NULL;
+    int ret = -5;
+    if(chunk==NULL || packed==NULL || offsets==NULL) goto done;
+    ret = -6;
+    f = fopen(out,"wb");
+    if(f==NULL) goto done;
+    // The index is written again once the chunk sizes are known
+    if(fwrite(&h,sizeof(h),1,f)!=1 || fwrite(offsets,sizeof(uint64_t),h.chunk_count+1,f)!=h.chunk_count+1) goto done;
+    offsets[0] = sizeof(h)+(h.chunk_count+1)*sizeof(uint64_t);
+    for (uint64_t i=0; i<h.chunk_count; i++) {
+        size_t length = h.image_size-i*chunk_size<chunk_size ? h.image_size-i*chunk_size : chunk_size;
+        if(fread(chunk,1,length,in)!=length) {
+            ret = -2;
+            goto done;
+        }
+        uLongf size = bound;
+        const char *stored = packed;
+        // Chunks that don't shrink are kept raw, readers tell them apart by their size
+        if(compress2((Bytef*)packed,&size,(Bytef*)chunk,length,Z_DEFAULT_COMPRESSION)!=Z_OK || size>=length) {
+            stored = chunk;
+            size = length;
+        }
+        if(fwrite(stored,1,size,f)!=size) goto done;
+        offsets[i+1] = offsets[i]+size;
+    }
+    if(fseeko(f,sizeof(h),SEEK_SET) || fwrite(offsets,sizeof(uint64_t),h.chunk_count+1,f)!=h.chunk_count+1) goto done;
+    ret = 0;
+done:
+    if(f && fclose(f) && ret==0) ret = -6;
+    fclose(in);
+    free(chunk);
+    free(packed);
+    free(offsets);
+    return ret;
+}
+
+size_t fatum_readblock(const fatum_t *vol, void *buffer, uint32_t first_block, size_t block_count) {
+    if(vol==NULL || buffer==NULL) {
+        return 0;
+    }
+    if(vol->zimage) {
+        pthread_mutex_lock(&vol->zimage->lock);
+        int ret = zimage_read(vol->zimage,buffer,(uint64_t)first_block*512,block_count*512);
+        pthread_mutex_unlock(&vol->zimage->lock);
+        return ret ? 0 : block_count;
+    }
+    FILE *f = fopen(vol->filename, "rb");
+    if (f==NULL) {
+        return 0;
+    }
+    fseeko(f,(off_t)first_block*512,SEEK_SET);
+    size_t ret = fread(buffer,512,block_count,f);
+    fclose(f);
+    if(ret!=block_count) {
+        return 0;
+    }
+    return block_count;
+}
+
+// FAT decoders, one per variant, all branch-free
+static uint32_t fat12_entry(const char *fat, uint32_t cluster) {
+    // Two entries share three bytes, odd ones take the upper 12 bits
+    const unsigned char *p = (const unsigned char*)fat+cluster+(cluster>>1);
+    uint32_t pair = p[0]|(p[1]<<8);
+    return (pair>>((cluster&1)<<2))&0xFFF;
+}
+
+static uint32_t fat16_entry(const char *fat, uint32_t cluster) {
+    return ((const unsigned short*)fat)[cluster];
+}
+
+static uint32_t fat32_entry(const char *fat, uint32_t cluster) {
+    return ((const uint32_t*)fat)[cluster]&FEV32_MASK;
+}
+
+static void fat12_space(const fatum_t *vol, fatum_space_t *space) {
+    uint32_t used=0, free=0, bad=0, last=0;
+    for (uint32_t c=2; c<vol->cluster_count+2; c++) {
+        uint32_t v = fat12_entry(vol->fat,c);
+        used += (v>=FEV_MIN)&(v<FEV12_BAD);
+        free += v==FEV_FREE;
+        bad += v==FEV12_BAD;
+        last += v>=FEV12_EOC;
+    }
+    space->used = used;
+    space->free = free;
+    space->bad = bad;
+    space->last = last;
+}
+
+static void fat16_space(const fatum_t *vol, fatum_space_t *space) {
+    const unsigned short *entry = (const unsigned short*)vol->fat+2;
+    uint32_t used=0, free=0, bad=0, last=0;
+    for (uint32_t i=0; i<vol->cluster_count; i++) {
+        uint32_t v = entry[i];
+        used += (v>=FEV_MIN)&(v<FEV16_BAD);
+        free += v==FEV_FREE;
+        bad += v==FEV16_BAD;
+        last += v>=FEV16_EOC;
+    }
+    space->used = used;
+    space->free = free;
+    space->bad = bad;
+    space->last = last;
+}
+
+static void fat32_space(const fatum_t *vol, fatum_space_t *space) {
+    const uint32_t *entry = (const uint32_t*)vol->fat+2;
+    uint32_t used=0, free=0, bad=0, last=0;
+    for (uint32_t i=0; i<vol->cluster_count; i++) {
+        uint32_t v = entry[i]&FEV32_MASK;
+        used += (v>=FEV_MIN)&(v<FEV32_BAD);
+        free += v==FEV_FREE;
+        bad += v==FEV32_BAD;
+        last += v>=FEV32_EOC;
+    }
+    space->used = used;
+    space->free = free;
+    space->bad = bad;
+    space->last = last;
+}
+
+int fatum_open(const char *path, fatum_t **vol) {
+    if(path==NULL || vol==NULL || path[0]=='\0') return 1;
+    fatum_t *v = calloc(1,sizeof(fatum_t));
+    if(v==NULL) return 3;
+    v->image_fd = -1;
+    strncpy(v->filename,path,sizeof(v->filename)-1);
+    int zret = zimage_open(path,&v->zimage);
+    if(zret>1) {
+        free(v);
+        return zret;
+    }
+
+    boot_t br;
+    if(!fatum_readblock(v,&br,LOC_VOLSTART,1)) {
+        fatum_close(v);
+        return 2;
+    }
+    v->br = br;
+    v->cluster_size = br.bytes_per_sector*br.sectors_per_cluster;
+    if(v->cluster_size==0 || br.number_of_fats==0 || br.bytes_per_sector%512 || FAT_SECTORS==0) {
+        fatum_close(v);
+        return 2;
+    }
+
+    uint32_t sectors_in_fs;
+    if(br.sectors_in_fs>br.sectors_in_fs_large) sectors_in_fs=br.sectors_in_fs;
+    else sectors_in_fs=br.sectors_in_fs_large;
+    uint64_t meta_sectors = br.reserved_area_size+br.number_of_fats*FAT_SECTORS+ROOT_SECTORS;
+    if(meta_sectors>=sectors_in_fs) {
+        fatum_close(v);
+        return 2;
+    }
+    uint32_t data_sectors = sectors_in_fs-meta_sectors;
+    v->cluster_count = data_sectors/br.sectors_per_cluster;
+    v->fat_bytes = FAT_SECTORS*br.bytes_per_sector;
+
+    // The variant follows from the cluster count alone
+    uint32_t fat_entries;
+    boot32_t *br32 = (boot32_t*)&br;
+    if(v->cluster_count<=FAT12_MAX_CLUSTERS) {
+        v->fat_type = 12;
+        v->fat_entry = fat12_entry;
+        v->space_scan = fat12_space;
+        v->bad = FEV12_BAD;
+        v->eoc = FEV12_EOC;
+        fat_entries = v->fat_bytes*2/3;
+    }
+    else if(v->cluster_count<=FAT16_MAX_CLUSTERS) {
+        v->fat_type = 16;
+        v->fat_entry = fat16_entry;
+        v->space_scan = fat16_space;
+        v->bad = FEV16_BAD;
+        v->eoc = FEV16_EOC;
+        fat_entries = v->fat_bytes/2;
+    }
+    else {
+        v->fat_type = 32;
+        v->fat_entry = fat32_entry;
+        v->space_scan = fat32_space;
+        v->bad = FEV32_BAD;
+        v->eoc = FEV32_EOC;
+        fat_entries = v->fat_bytes/4;
+        v->root_cluster = br32->root_cluster&FEV32_MASK;
+    }
+    // Clusters without a FAT entry can't be addressed
+    if(fat_entries<2) v->cluster_count = 0;
+    else if(v->cluster_count>fat_entries-2) v->cluster_count = fat_entries-2;
+    if(v->fat_type==32 && !fatum_valid_cluster(v,v->root_cluster)) {
+        fatum_close(v);
+        return 2;
+    }
+
+    v->fats = calloc(br.number_of_fats,sizeof(char*));
+    if(v->fats==NULL) {
+        fatum_close(v);
+        return 3;
+    }
+    for (int i=0; i<br.number_of_fats; i++) {
+        // One spare byte so the last FAT12 entry can be read as a pair
+        v->fats[i] = calloc(1,v->fat_bytes+1);
+        if(v->fats[i]==NULL) {
+            fatum_close(v);
+            return 3;
+        }
+        if(!fatum_readblock(v, v->fats[i], LOC_FAT1START+(FAT_SECTORS*br.bytes_per_sector)/512*i, v->fat_bytes/512)) {
+            fatum_close(v);
+            return 2;
+        }
+    }
+    v->fat = v->fats[0];
+    v->mirrored = 1;
+    if(v->fat_type==32 && (br32->ext_flags&0x80)) {
+        v->mirrored = 0;
+        if((br32->ext_flags&0x0F)<br.number_of_fats) v->fat = v->fats[br32->ext_flags&0x0F];
+    }
+
+    v->free_hint = FSI_UNKNOWN;
+    if(v->fat_type==32 && br32->fsinfo_sector>0 && br32->fsinfo_sector<br.reserved_area_size) {
+        fsinfo_t *info = malloc(br.bytes_per_sector);
+        if(info && fatum_readblock(v,info,br32->fsinfo_sector*br.bytes_per_sector/512,1)) {
+            if(info->lead_signature==FSI_LEAD_SIG && info->struct_signature==FSI_STRUCT_SIG && info->free_count<=v->cluster_count) v->free_hint = info->free_count;
+        }
+        free(info);
+    }
+
+    if(v->fat_type!=32) {
+        v->root = calloc(1,ROOT_SECTORS*br.bytes_per_sector);
+        if(v->root==NULL) {
+            fatum_close(v);
+            return 3;
+        }
+        if(!fatum_readblock(v, v->root, LOC_ROOTSTART, ROOT_SECTORS*br.bytes_per_sector/512)) {
+            fatum_close(v);
+            return 2;
+        }
+    }
+
+    size_t data_bytes = (size_t)data_sectors*br.bytes_per_sector;
+    v->data_offset = (uint64_t)LOC_DATASTART*512;
+    if(v->zimage) {
+        // Only reserved: pages get memory when their clusters are decompressed into them
+        void *map = mmap(NULL,data_bytes,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+        if(map==MAP_FAILED) {
+            fatum_close(v);
+            return 3;
+        }
+        v->map = map;
+        v->map_size = data_bytes;
+        v->data = v->map;
+        if(v->data_offset+data_bytes>v->zimage->image_size) {
+            fatum_close(v);
+            return 2;
+        }
+        v->loaded = calloc(1,v->cluster_count/8+1);
+        if(v->loaded==NULL) {
+            fatum_close(v);
+            return 3;
+        }
+    }
+    else {
+        // Clusters are paged in from the image as they're used, whatever the volume size
+        struct stat sb;
+        v->image_fd = open(v->filename,O_RDONLY);
+        if(v->image_fd<0 || fstat(v->image_fd,&sb) || (uint64_t)sb.st_size<v->data_offset+data_bytes) {
+            fatum_close(v);
+            return 2;
+        }
+        v->map_size = v->data_offset+data_bytes;
+        void *map = mmap(NULL,v->map_size,PROT_READ,MAP_PRIVATE,v->image_fd,0);
+        if(map==MAP_FAILED) {
+            fatum_close(v);
+            return 3;
+        }
+        v->map = map;
+        v->data = v->map+v->data_offset;
+    }
+
+    *vol = v;
+    return 0;
+}
+
+void fatum_close(fatum_t *vol) {
+    if(vol==NULL) return;
+    if(vol->fats) {
+        for (int i=0; i<vol->br.number_of_fats; i++) if(vol->fats[i]) free(vol->fats[i]);
+        free(vol->fats);
+    }
+    if(vol->root) free(vol->root);
+    if(vol->map) munmap(vol->map,vol->map_size);
+    if(vol->image_fd>=0) close(vol->image_fd);
+    zimage_close(vol->zimage);
+    free(vol->loaded);
+    free(vol);
+}
+
+int fatum_valid_cluster(const fatum_t *vol, uint32_t cluster) {
+    // Wraps around for 0 and 1, and every marker is above the last cluster
+    return cluster-2<vol->cluster_count;
+}
+
+uint32_t fatum_next_cluster(const fatum_t *vol, uint32_t cluster) {
+    if(cluster-2>=vol->cluster_count) return vol->bad;
+    return vol->fat_entry(vol->fat,cluster);
+}
+
+uint32_t fatum_first_cluster(const fatum_t *vol, const entry_data_t *entry) {
+    if(vol->fat_type==32) return (((uint32_t)entry->high_order_address_bytes<<16)|entry->low_order_address_bytes)&FEV32_MASK;
+    return entry->low_order_address_bytes;
+}
+
+char *fatum_cluster_ptr(const fatum_t *vol, uint32_t cluster) {
+    // A chunk that can't be decompressed leaves its clusters zeroed
+    if(vol->loaded && fatum_valid_cluster(vol,cluster)) load_clusters(vol,cluster,1);
+    return vol->data+(size_t)(cluster-2)*vol->cluster_size;
+}
+
+// Pointer to len bytes at offset of the run starting at cluster, NULL if they couldn't be decompressed
+static char *run_ptr(const fatum_t *vol, uint32_t cluster, size_t offset, size_t len) {
+    if(vol->loaded && len>0) {
+        uint32_t first = offset/vol->cluster_size;
+        uint32_t last = (offset+len-1)/vol->cluster_size;
+        if(load_clusters(vol,cluster+first,last-first+1)) return NULL;
+    }
+    return vol->data+(size_t)(cluster-2)*vol->cluster_size+offset;
+}
+
+void fatum_space(const fatum_t *vol, fatum_space_t *space, char use_hint) {
+    memset(space,0,sizeof(fatum_space_t));
+    if(use_hint && vol->free_hint!=FSI_UNKNOWN) {
+        space->free = vol->free_hint;
+        space->used = vol->cluster_count-vol->free_hint;
+        space->hinted = 1;
+        return;
+    }
+    vol->space_scan(vol,space);
+}
+
+int fatum_format_filename(const char *filename, char *dst) {
+    if(filename==NULL) return -1;
+    int pos=0;
+
+    for (int i=0; i<8; i++) {
+        if(filename[i]==' ') break;
+        dst[pos]=filename[i];
+        pos++;
+    }
+
+    if(filename[8]==' ') {
+        dst[pos]='\0';
+        return 0;
+    }
+
+    dst[pos]='.';
+    pos++;
+    for (int i=0; i<3; i++) {
+        if(filename[8+i]==' ') break;
+        dst[pos]=filename[8+i];
+        pos++;
+    }
+    dst[pos]='\0';
+    return 0;
+}
+
+int fatum_hidden_in_dir(entry_data_t *entry, char hide_dots) {
+    if(entry->filename[0]==FEI_DELETED) return 1;
+    if(entry->attributes==FAF_LFN) return 1;
+    if(hide_dots && *(entry->filename)=='.') return 1;
+    return 0;
+}
+
+filedate_t fatum_get_date(short date) {
+    filedate_t fd;
+    fd.year=(date&DAT_YEAR)>>SHIFT_YEAR;
+    fd.year+=1980;
+    fd.month=(date&DAT_MONTH)>>SHIFT_MONTH;
+    fd.day=(date&DAT_DAY);
+    return fd;
+}
+
+filetime_t fatum_get_time(short time) {
+    filetime_t ft;
+    ft.hrs=(time&DAT_HOUR)>>SHIFT_HOUR;
+    ft.min=(time&DAT_MIN)>>SHIFT_MIN;
+    ft.sec=(time&DAT_SEC)*2;
+    return ft;
+}
+
+static entry_data_t *next_entry(fatum_dir_t *dir, char hide_dots) {
+    while(dir->current) {
+        if(dir->offset>=dir->size) {
+            if(dir->cluster==0) break;
+            uint32_t next = fatum_next_cluster(dir->vol,dir->cluster);
+            if(!fatum_valid_cluster(dir->vol,next) || ++dir->visited>dir->vol->cluster_count) break;
+            dir->cluster = next;
+            dir->current = (entry_data_t*)fatum_cluster_ptr(dir->vol,next);
+            dir->offset = 0;
+        }
+        entry_data_t *entry = dir->current;
+        if(entry->filename[0]==FEI_UNALLOC) break;
+        dir->current++;
+        dir->offset += sizeof(entry_data_t);
+        if(fatum_hidden_in_dir(entry,hide_dots)) continue;
+        if(entry->attributes==FAF_VOL_LABEL) continue;
+        return entry;
+    }
+    dir->current = NULL;
+    return NULL;
+}
+
+static void init_dir(fatum_dir_t *dir, fatum_t *vol, uint32_t cluster) {
+    dir->vol = vol;
+    dir->offset = 0;
+    dir->visited = 0;
+    if(cluster==0) cluster = vol->root_cluster;
+    dir->cluster = cluster;
+    if(cluster==0) {
+        dir->current = vol->root;
+        dir->size = vol->br.max_files_in_root*sizeof(entry_data_t);
+    }
+    else {
+        dir->current = (entry_data_t*)fatum_cluster_ptr(vol,cluster);
+        dir->size = vol->cluster_size;
+    }
+}
+
+static int match_name(const entry_data_t *entry, const char *name, size_t len) {
+    char formatted[13];
+    fatum_format_filename(entry->filename,formatted);
+    if(strlen(formatted)!=len) return 0;
+    for (size_t i=0; i<len; i++) {
+        if(tolower((unsigned char)formatted[i])!=tolower((unsigned char)name[i])) return 0;
+    }
+    return 1;
+}
+
+static int find_in(fatum_t *vol, const entry_data_t *dir, const char *name, size_t len, entry_data_t **entry) {
+    uint32_t cluster = 0;
+    if(dir) {
+        if(!(dir->attributes & FAF_DIR)) return -3;
+        cluster = fatum_first_cluster(vol,dir);
+        if(cluster!=0 && !fatum_valid_cluster(vol,cluster)) return -2;
+    }
+    fatum_dir_t d;
+    init_dir(&d,vol,cluster);
+    entry_data_t *found;
+    while((found=next_entry(&d,0))!=NULL) {
+        if(match_name(found,name,len)) {
+            *entry = found;
+            return 0;
+        }
+    }
+    return -2;
+}
+
+int fatum_find(fatum_t *vol, const entry_data_t *dir, const char *name, entry_data_t **entry) {
+    if(vol==NULL || name==NULL || entry==NULL) return -1;
+    return find_in(vol,dir,name,strlen(name),entry);
+}
+
+int fatum_lookup(fatum_t *vol, const char *path, entry_data_t **entry) {
+    if(vol==NULL || path==NULL || entry==NULL) return -1;
+    entry_data_t *current = NULL;
+    const char *pos = path;
+    while(*pos) {
+        while(*pos=='\\' || *pos=='/') pos++;
+        if(*pos=='\0') break;
+        size_t len = strcspn(pos,"\\/");
+        entry_data_t *found;
+        int ret = find_in(vol,current,pos,len,&found);
+        if(ret) return ret;
+        // ".." pointing at cluster 0 (or the FAT32 root chain) leads back to the root
+        uint32_t cluster = fatum_first_cluster(vol,found);
+        if((found->attributes & FAF_DIR) && (cluster==0 || cluster==vol->root_cluster)) current = NULL;
+        else current = found;
+        pos += len;
+    }
+    *entry = current;
+    return 0;
+}
+
+void fatum_stat_entry(const fatum_t *vol, const entry_data_t *entry, fatum_stat_t *st) {
+    memset(st,0,sizeof(fatum_stat_t));
+    if(entry==NULL) {
+        strcpy(st->name,"\\");
+        st->attributes = FAF_DIR;
+        return;
+    }
+    fatum_format_filename(entry->filename,st->name);
+    st->attributes = entry->attributes;
+    st->size = entry->file_size;
+    st->first_cluster = fatum_first_cluster(vol,entry);
+    st->created_date = fatum_get_date(entry->creation_date);
+    st->created_time = fatum_get_time(entry->creation_time);
+    st->modified_date = fatum_get_date(entry->modified_date);
+    st->modified_time = fatum_get_time(entry->modified_time);
+    st->access_date = fatum_get_date(entry->access_date);
+}
+
+int fatum_stat(fatum_t *vol, const char *path, fatum_stat_t *st) {
+    if(st==NULL) return -1;
+    entry_data_t *entry;
+    int ret = fatum_lookup(vol,path,&entry);
+    if(ret) return ret;
+    fatum_stat_entry(vol,entry,st);
+    return 0;
+}
+
+int fatum_opendir_entry(fatum_t *vol, const entry_data_t *entry, fatum_dir_t **dir) {
+    if(vol==NULL || dir==NULL) return -1;
+    uint32_t cluster = 0;
+    if(entry) {
+        if(!(entry->attributes & FAF_DIR)) return -3;
+        cluster = fatum_first_cluster(vol,entry);
+        if(cluster!=0 && !fatum_valid_cluster(vol,cluster)) return -4;
+    }
+    fatum_dir_t *d = malloc(sizeof(fatum_dir_t));
+    if(d==NULL) return -5;
+    init_dir(d,vol,cluster);
+    *dir = d;
+    return 0;
+}
+
+int fatum_opendir(fatum_t *vol, const char *path, fatum_dir_t **dir) {
+    entry_data_t *entry;
+    int ret = fatum_lookup(vol,path,&entry);
+    if(ret) return ret;
+    return fatum_opendir_entry(vol,entry,dir);
+}
+
+int fatum_readdir(fatum_dir_t *dir, fatum_stat_t *st, entry_data_t **entry) {
+    if(dir==NULL) return 0;
+    entry_data_t *found = next_entry(dir,1);
+    if(found==NULL) return 0;
+    if(st) fatum_stat_entry(dir->vol,found,st);
+    if(entry) *entry = found;
+    return 1;
+}
+
+void fatum_closedir(fatum_dir_t *dir) {
+    free(dir);
+}
+
+int fatum_fopen_entry(fatum_t *vol, const entry_data_t *entry, fatum_file_t **file) {
+    if(vol==NULL || entry==NULL || file==NULL) return -1;
+    if(entry->filename[0]==FEI_UNALLOC || entry->filename[0]==FEI_DELETED) return -2;
+    if(entry->attributes & FAF_DIR) return -3;
+    fatum_file_t *f = calloc(1,sizeof(fatum_file_t));
+    if(f==NULL) return -5;
+    f->vol = vol;
+    f->entry = *entry;
+
+    uint32_t needed = ((uint64_t)entry->file_size+vol->cluster_size-1)/vol->cluster_size;
+    uint32_t cluster = fatum_first_cluster(vol,entry);
+    size_t capacity = 0;
+    for (uint32_t index=0; index<needed; index++) {
+        if(!fatum_valid_cluster(vol,cluster)) {
+            if(cluster>=vol->eoc) break;
+            fatum_fclose(f);
+            return -4;
+        }
+        extent_t *last = f->extent_count ? &f->extents[f->extent_count-1] : NULL;
+        if(last && last->cluster+last->count==cluster) last->count++;
+        else {
+            if(f->extent_count==capacity) {
+                capacity = capacity ? capacity*2 : 8;
+                extent_t *grown = realloc(f->extents,capacity*sizeof(extent_t));
+                if(grown==NULL) {
+                    fatum_fclose(f);
+                    return -5;
+                }
+                f->extents = grown;
+            }
+            f->extents[f->extent_count].first_index = index;
+            f->extents[f->extent_count].cluster = cluster;
+            f->extents[f->extent_count].count = 1;
+            f->extent_count++;
+        }
+        cluster = fatum_next_cluster(vol,cluster);
+    }
+    *file = f;
+    return 0;
+}
+
+int fatum_fopen(fatum_t *vol, const char *path, fatum_file_t **file) {
+    entry_data_t *entry;
+    int ret = fatum_lookup(vol,path,&entry);
+    if(ret) return ret;
+    if(entry==NULL) return -3;
+    return fatum_fopen_entry(vol,entry,file);
+}
+
+void fatum_fclose(fatum_file_t *file) {
+    if(file==NULL) return;
+    free(file->extents);
+    free(file);
+}
+
+// Index of the extent holding the given cluster index (last one starting at or before it)
+static size_t find_extent(const fatum_file_t *file, uint32_t index) {
+    size_t lo = 0, hi = file->extent_count;
+    while(hi-lo>1) {
+        size_t mid = lo+(hi-lo)/2;
+        if(file->extents[mid].first_index<=index) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+ssize_t fatum_pread(fatum_file_t *file, void *buf, size_t len, uint32_t offset) {
+    if(file==NULL || buf==NULL) return -1;
+    uint32_t size = file->entry.file_size;
+    if(offset>=size || file->extent_count==0) return 0;
+    if(len>size-offset) len = size-offset;
+    uint32_t cluster_size = file->vol->cluster_size;
+    uint32_t index = offset/cluster_size;
+    size_t e = find_extent(file,index);
+    size_t run_offset = (size_t)(index-file->extents[e].first_index)*cluster_size+offset%cluster_size;
+    size_t done = 0;
+    while(done<len && e<file->extent_count) {
+        extent_t *x = &file->extents[e];
+        size_t run_size = (size_t)x->count*cluster_size;
+        if(run_offset>=run_size) break;
+        size_t n = run_size-run_offset;
+        if(n>len-done) n = len-done;
+        char *p = run_ptr(file->vol,x->cluster,run_offset,n);
+        if(p==NULL) break;
+        memcpy((char*)buf+done,p,n);
+        done += n;
+        run_offset = 0;
+        e++;
+    }
+    return done;
+}
+
+ssize_t fatum_map(fatum_file_t *file, uint32_t offset, size_t len, const char **data) {
+    if(file==NULL || data==NULL) return -1;
+    uint32_t size = file->entry.file_size;
+    if(offset>=size || file->extent_count==0) return 0;
+    if(len>size-offset) len = size-offset;
+    uint32_t cluster_size = file->vol->cluster_size;
+    uint32_t index = offset/cluster_size;
+    extent_t *x = &file->extents[find_extent(file,index)];
+    size_t run_offset = (size_t)(index-x->first_index)*cluster_size+offset%cluster_size;
+    size_t run_size = (size_t)x->count*cluster_size;
+    if(run_offset>=run_size) return 0;
+    if(len>run_size-run_offset) len = run_size-run_offset;
+    char *p = run_ptr(file->vol,x->cluster,run_offset,len);
+    if(p==NULL) return -4;
+    *data = p;
+    return len;
+}
+
+void fatum_table_free(fatum_table_t *table) {
+    if(table==NULL) return;
+    free(table->size);
+    free(table->modified);
+    free(table->created);
+    free(table->accessed);
+    free(table->first_cluster);
+    free(table->parent);
+    free(table->attributes);
+    free(table->name);
+    free(table);
+}
+
+static int table_grow(fatum_table_t *t) {
+    size_t cap = t->capacity ? t->capacity*2 : 1024;
+    void *p;
+    if((p=realloc(t->size,cap*sizeof(uint32_t)))==NULL) return -5;
+    t->size = p;
+    if((p=realloc(t->modified,cap*sizeof(uint32_t)))==NULL) return -5;
+    t->modified = p;
+    if((p=realloc(t->created,cap*sizeof(uint32_t)))==NULL) return -5;
+    t->created = p;
+    if((p=realloc(t->accessed,cap*sizeof(uint16_t)))==NULL) return -5;
+    t->accessed = p;
+    if((p=realloc(t->first_cluster,cap*sizeof(uint32_t)))==NULL) return -5;
+    t->first_cluster = p;
+    if((p=realloc(t->parent,cap*sizeof(uint32_t)))==NULL) return -5;
+    t->parent = p;
+    if((p=realloc(t->attributes,cap*sizeof(uint8_t)))==NULL) return -5;
+    t->attributes = p;
+    if((p=realloc(t->name,cap*sizeof(*t->name)))==NULL) return -5;
+    t->name = p;
+    t->capacity = cap;
+    return 0;
+}
+
+uint32_t fatum_timestamp(short date, short time) {
+    return ((uint32_t)(unsigned short)date<<16)|(unsigned short)time;
+}
+
+static int table_add_dir(fatum_t *vol, fatum_table_t *t, const entry_data_t *dir, uint32_t parent, uint32_t depth) {
+    fatum_dir_t d;
+    uint32_t cluster = 0;
+    if(dir) {
+        cluster = fatum_first_cluster(vol,dir);
+        if(!fatum_valid_cluster(vol,cluster)) return 0;
+    }
+    init_dir(&d,vol,cluster);
+    entry_data_t *entry;
+    while((entry=next_entry(&d,1))!=NULL) {
+        if(t->count==t->capacity && table_grow(t)) return -5;
+        size_t row = t->count++;
+        t->size[row] = entry->file_size;
+        t->modified[row] = fatum_timestamp(entry->modified_date,entry->modified_time);
+        t->created[row] = fatum_timestamp(entry->creation_date,entry->creation_time);
+        t->accessed[row] = entry->access_date;
+        t->first_cluster[row] = fatum_first_cluster(vol,entry);
+        t->parent[row] = parent;
+        t->attributes[row] = entry->attributes;
+        fatum_format_filename(entry->filename,t->name[row]);
+        // Looped directory chains would recurse forever
+        if((entry->attributes & FAF_DIR) && depth<FATUM_MAX_DEPTH) {
+            if(table_add_dir(vol,t,entry,row,depth+1)) return -5;
+        }
+    }
+    return 0;
+}
+
+int fatum_table_build(fatum_t *vol, fatum_table_t **table) {
+    if(vol==NULL || table==NULL) return -1;
+    fatum_table_t *t = calloc(1,sizeof(fatum_table_t));
+    if(t==NULL) return -5;
+    if(table_add_dir(vol,t,NULL,FATUM_NO_PARENT,0)) {
+        fatum_table_free(t);
+        return -5;
+    }
+    *table = t;
+    return 0;
+}
+
+void fatum_query_init(fatum_query_t *query) {
+    query->min_size = 0;
+    query->max_size = UINT32_MAX;
+    query->modified_from = 0;
+    query->modified_to = UINT32_MAX;
+    query->attr_set = 0;
+    query->attr_clear = 0;
+}
+
+// One branch-free pass over the columns, so the compiler can vectorize it
+size_t fatum_table_filter(const fatum_table_t *table, const fatum_query_t *query, uint8_t *mask) {
+    const uint32_t *size = table->size;
+    const uint32_t *modified = table->modified;
+    const uint8_t *attributes = table->attributes;
+    const uint32_t min_size = query->min_size;
+    const uint32_t max_size = query->max_size;
+    const uint32_t from = query->modified_from;
+    const uint32_t to = query->modified_to;
+    const uint8_t set = query->attr_set;
+    const uint8_t clear = query->attr_clear;
+    // Kept in a local, otherwise stores to mask could alias it and stop vectorization
+    const size_t count = table->count;
+    size_t matches = 0;
+    for (size_t i=0; i<count; i++) {
+        uint8_t m = (size[i]>=min_size) & (size[i]<=max_size)
+            & (modified[i]>=from) & (modified[i]<=to)
+            & ((attributes[i]&set)==set) & ((attributes[i]&clear)==0);
+        mask[i] = m;
+        matches += m;
+    }
+    return matches;
+}
+
+size_t fatum_table_path(const fatum_table_t *table, size_t row, char *buf, size_t len) {
+    size_t needed = 0;
+    for (uint32_t r=row; r!=FATUM_NO_PARENT; r=table->parent[r]) needed += strlen(table->name[r])+1;
+    if(needed+1>len) return 0;
+    buf[needed] = '\0';
+    size_t pos = needed;
+    for (uint32_t r=row; r!=FATUM_NO_PARENT; r=table->parent[r]) {
+        size_t n = strlen(table->name[r]);
+        pos -= n;
+        memcpy(buf+pos,table->name[r],n);
+        buf[--pos] = '\\';
+    }
+    return needed;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while(len>0) {
+        ssize_t n = write(fd,buf,len);
+        if(n<0) {
+            if(errno==EINTR) continue;
+            return -6;
+        }
+        buf+=n;
+        len-=n;
+    }
+    return 0;
+}
+
+ssize_t fatum_sendfile(fatum_file_t *file, int fd) {
+    if(file==NULL) return -1;
+    fatum_t *vol = file->vol;
+    char use_sendfile = vol->image_fd>=0;
+    uint64_t left = file->entry.file_size;
+    ssize_t written = 0;
+    for (size_t e=0; e<file->extent_count && left>0; e++) {
+        extent_t *x = &file->extents[e];
+        size_t n = (size_t)x->count*vol->cluster_size;
+        if(n>left) n = left;
+        left-=n;
+        off_t pos = vol->data_offset+(uint64_t)(x->cluster-2)*vol->cluster_size;
+        char *p = run_ptr(vol,x->cluster,0,n);
+        if(p==NULL) break;
+        written+=n;
+        while(n>0 && use_sendfile) {
+            ssize_t sent = sendfile(fd,vol->image_fd,&pos,n);
+            if(sent<0 && errno==EINTR) continue;
+            // Output kinds sendfile() can't handle fall back to writing from memory
+            if(sent<=0) {
+                if(sent<0 && errno!=EINVAL && errno!=ENOSYS) return -6;
+                use_sendfile = 0;
+                break;
+            }
+            p+=sent;
+            n-=sent;
+        }
+        if(n>0 && write_all(fd,p,n)) return -6;
+    }
+    return written;
+}
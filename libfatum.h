@@ -0,0 +1,184 @@
+#ifndef LIBFATUM_H
+#define LIBFATUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "fat.h"
+
+// Run of physically contiguous clusters inside a file's chain
+typedef struct fatum_extent {
+    uint32_t first_index; // index of the run's first cluster within the file (0 = first cluster of the file)
+    uint32_t cluster; // first cluster number of the run
+    uint32_t count; // clusters in the run
+} extent_t;
+
+// Compressed image: header, chunk_count+1 absolute chunk offsets (uint64), then the image's fixed-size
+// chunks compressed one by one with zlib. A chunk stored with its raw size isn't compressed.
+#define FATUM_Z_MAGIC "FATUMZ01"
+#define FATUM_Z_CHUNK_SIZE (1<<16)
+#define FATUM_Z_CHUNK_MAX (1<<24)
+#define FATUM_Z_CACHE 8 // decompressed chunks kept in memory
+
+typedef struct __attribute__ ((__packed__)) zheader {
+    char magic[8];
+    uint32_t chunk_size;
+    uint32_t reserved;
+    uint64_t image_size; // uncompressed
+    uint64_t chunk_count;
+} fatum_zheader_t;
+
+struct fatum_zimage;
+
+typedef struct fatum_space {
+    uint32_t used;
+    uint32_t free;
+    uint32_t bad;
+    uint32_t last; // ending clusters of chains
+    char hinted; // free count taken from FAT32 FSInfo; used includes bad and last, which stay 0
+} fatum_space_t;
+
+typedef struct fatum_volume {
+    char filename[256];
+    boot_t br;
+    int fat_type; // 12, 16 or 32
+    char **fats;
+    const char *fat; // active FAT, used for all lookups
+    uint32_t fat_bytes; // size of one FAT
+    char mirrored; // FATs are expected to be identical
+    entry_data_t *root; // fixed root directory, NULL for FAT32
+    uint32_t root_cluster; // root directory chain for FAT32, 0 otherwise
+    char *data; // data area, read-only view of the image for raw images, filled as clusters are used for compressed ones
+    char *map; // mapping holding the data area
+    size_t map_size;
+    uint32_t cluster_size; // in bytes
+    uint32_t cluster_count; // clusters in the data area
+    uint32_t bad; // bad cluster marker of this variant
+    uint32_t eoc; // lowest end-of-chain marker of this variant
+    uint32_t free_hint; // FSInfo free cluster count, FSI_UNKNOWN if missing
+    // Variant decoders picked at open time
+    uint32_t (*fat_entry)(const char *fat, uint32_t cluster);
+    void (*space_scan)(const struct fatum_volume *vol, struct fatum_space *space);
+    uint64_t data_offset; // of the data area in the image file, in bytes
+    int image_fd; // kept open for fatum_sendfile, -1 if unavailable
+    struct fatum_zimage *zimage; // compressed image reader, NULL for raw images
+    uint8_t *loaded; // bitmap of data area clusters read so far, NULL if the whole area is in memory
+} fatum_t;
+
+typedef struct fatum_file {
+    fatum_t *vol;
+    entry_data_t entry;
+    extent_t *extents; // sorted by first_index
+    size_t extent_count;
+} fatum_file_t;
+
+typedef struct fatum_stat {
+    char name[13];
+    char attributes;
+    uint32_t size;
+    uint32_t first_cluster;
+    filedate_t created_date;
+    filetime_t created_time;
+    filedate_t modified_date;
+    filetime_t modified_time;
+    filedate_t access_date;
+} fatum_stat_t;
+
+typedef struct fatum_dir {
+    fatum_t *vol;
+    entry_data_t *current;
+    uint32_t cluster; // 0 for root
+    uint32_t offset; // bytes consumed in current cluster (or root area)
+    uint32_t size; // bytes in current cluster (or root area)
+    uint32_t visited; // clusters walked, guards against looped chains
+} fatum_dir_t;
+
+#define FATUM_NO_PARENT UINT32_MAX
+#define FATUM_MAX_DEPTH 256
+
+// Metadata of every entry on the volume, one array per column.
+// Timestamps are kept as FAT date<<16|time, which orders like the time it encodes.
+typedef struct fatum_table {
+    size_t count;
+    size_t capacity;
+    uint32_t *size;
+    uint32_t *modified;
+    uint32_t *created;
+    uint16_t *accessed;
+    uint32_t *first_cluster;
+    uint32_t *parent; // row of the parent directory, FATUM_NO_PARENT in root
+    uint8_t *attributes;
+    char (*name)[13];
+} fatum_table_t;
+
+// Inclusive bounds, fatum_query_init() sets them to match everything
+typedef struct fatum_query {
+    uint32_t min_size;
+    uint32_t max_size;
+    uint32_t modified_from;
+    uint32_t modified_to;
+    uint8_t attr_set; // attributes that must be set
+    uint8_t attr_clear; // attributes that must be clear
+} fatum_query_t;
+
+// Volume: returns 0 on success, 1 no filename, 2 read failure, 3 allocation failure.
+// Compressed images are recognized by their header; their data area is decompressed as clusters are used.
+int fatum_open(const char *path, fatum_t **vol);
+void fatum_close(fatum_t *vol);
+size_t fatum_readblock(const fatum_t *vol, void *buffer, uint32_t first_block, size_t block_count);
+// Writes raw image in the compressed format, chunk_size 0 picks FATUM_Z_CHUNK_SIZE.
+// Returns 0 on success, -1 wrong arguments, -2 input can't be read, -5 allocation failure, -6 write error
+int fatum_compress(const char *raw, const char *out, uint32_t chunk_size);
+
+// Cluster chain helpers
+int fatum_valid_cluster(const fatum_t *vol, uint32_t cluster);
+uint32_t fatum_next_cluster(const fatum_t *vol, uint32_t cluster);
+uint32_t fatum_first_cluster(const fatum_t *vol, const entry_data_t *entry);
+char *fatum_cluster_ptr(const fatum_t *vol, uint32_t cluster);
+// With use_hint, FAT32 volumes with a valid FSInfo free count skip the table scan
+void fatum_space(const fatum_t *vol, fatum_space_t *space, char use_hint);
+
+// Entry helpers: 8.3 name as "NAME.EXT" (dst holds 13 bytes), deleted/LFN (and with hide_dots "."/"..") check, FAT date and time
+int fatum_format_filename(const char *filename, char *dst);
+int fatum_hidden_in_dir(entry_data_t *entry, char hide_dots);
+filedate_t fatum_get_date(short date);
+filetime_t fatum_get_time(short time);
+
+// Finds a single name (dots included) in dir, NULL being the root. Returns 0 or -2 if not found
+int fatum_find(fatum_t *vol, const entry_data_t *dir, const char *name, entry_data_t **entry);
+// Path lookup, '\' or '/' separated, case-insensitive. Root gives *entry==NULL.
+// Returns 0 on success, -1 wrong arguments, -2 not found, -3 component is not a directory
+int fatum_lookup(fatum_t *vol, const char *path, entry_data_t **entry);
+int fatum_stat(fatum_t *vol, const char *path, fatum_stat_t *st);
+void fatum_stat_entry(const fatum_t *vol, const entry_data_t *entry, fatum_stat_t *st);
+
+// Directory iterator: fatum_readdir returns 1 if st was filled, 0 at the end
+int fatum_opendir(fatum_t *vol, const char *path, fatum_dir_t **dir);
+int fatum_opendir_entry(fatum_t *vol, const entry_data_t *entry, fatum_dir_t **dir);
+int fatum_readdir(fatum_dir_t *dir, fatum_stat_t *st, entry_data_t **entry);
+void fatum_closedir(fatum_dir_t *dir);
+
+// Files: returns 0 on success, -1 wrong arguments, -2 not found/deleted, -3 directory, -4 corrupted chain, -5 allocation failure
+int fatum_fopen(fatum_t *vol, const char *path, fatum_file_t **file);
+int fatum_fopen_entry(fatum_t *vol, const entry_data_t *entry, fatum_file_t **file);
+void fatum_fclose(fatum_file_t *file);
+// Reads up to len bytes at offset, returns bytes read (0 past the end) or -1 on wrong arguments
+ssize_t fatum_pread(fatum_file_t *file, void *buf, size_t len, uint32_t offset);
+// Points *data at up to len bytes of the file at offset, decompressing them if needed, without copying.
+// Stops at the end of a contiguous run. Returns the byte count (0 past the end), -1 wrong arguments, -4 if a compressed chunk can't be read
+ssize_t fatum_map(fatum_file_t *file, uint32_t offset, size_t len, const char **data);
+// Writes the whole file to fd, with sendfile() straight from the image where the kernel allows it.
+// Returns bytes written, less than the file size if its chain ends early or a compressed chunk can't be read; -6 on write error
+ssize_t fatum_sendfile(fatum_file_t *file, int fd);
+
+// Table: fatum_table_build returns 0 on success, -5 allocation failure
+int fatum_table_build(fatum_t *vol, fatum_table_t **table);
+void fatum_table_free(fatum_table_t *table);
+void fatum_query_init(fatum_query_t *query);
+uint32_t fatum_timestamp(short date, short time);
+// Sets mask[i] to 1 for every matching row, returns number of matches
+size_t fatum_table_filter(const fatum_table_t *table, const fatum_query_t *query, uint8_t *mask);
+// Writes "\DIR\FILE" path of a row, returns its length (0 if it didn't fit)
+size_t fatum_table_path(const fatum_table_t *table, size_t row, char *buf, size_t len);
+
+#endif //LIBFATUM_H
@@ -0,0 +1,573 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+int response_reserve(response_t *r, size_t len) {
+    if(r->size+len<=r->cap) return 0;
+    size_t cap = r->cap ? r->cap : 4096;
+    while(cap<r->size+len) cap*=2;
+    char *grown = realloc(r->buf,cap);
+    if(grown==NULL) return -5;
+    r->buf = grown;
+    r->cap = cap;
+    return 0;
+}
+
+int response_printf(response_t *r, const char *fmt, ...) {
+    va_list args;
+    va_start(args,fmt);
+    int len = vsnprintf(NULL,0,fmt,args);
+    va_end(args);
+    if(len<0 || response_reserve(r,len+1)) return -5;
+    va_start(args,fmt);
+    vsnprintf(r->buf+r->size,len+1,fmt,args);
+    va_end(args);
+    r->size+=len;
+    return 0;
+}
+
+static int srv_status(int ret, char dir_expected) {
+    switch(ret) {
+        case 0: return SRV_OK;
+        case -2: return SRV_NOT_FOUND;
+        case -3: return dir_expected ? SRV_NOT_DIR : SRV_IS_DIR;
+        case -4: return SRV_CORRUPTED;
+        case -5: return SRV_NO_MEMORY;
+    }
+    return SRV_BAD_REQUEST;
+}
+
+static int serve_dir(fatum_t *vol, const char *path, response_t *r) {
+    fatum_dir_t *dir;
+    int ret = fatum_opendir(vol,path,&dir);
+    if(ret) return srv_status(ret,1);
+    fatum_stat_t st;
+    while(fatum_readdir(dir,&st,NULL)) {
+        ret = response_printf(r,"%02d/%02d/%04d %02d:%02d %-13s",st.modified_date.day,st.modified_date.month,st.modified_date.year,st.modified_time.hrs,st.modified_time.min,st.name);
+        if(ret==0) {
+            if(st.attributes & FAF_DIR) ret = response_printf(r,"<DIR>\n");
+            else ret = response_printf(r,"%u B\n",st.size);
+        }
+        if(ret) break;
+    }
+    fatum_closedir(dir);
+    return srv_status(ret,1);
+}
+
+// Only opens the file, the event loop reads and sends its body piece by piece
+static int serve_file(fatum_t *vol, const char *path, uint32_t offset, uint32_t len, stream_t *stream) {
+    fatum_file_t *file;
+    int ret = fatum_fopen(vol,path,&file);
+    if(ret) return srv_status(ret,0);
+    // The length goes out first, so a chain shorter than the file size limits it up front
+    uint64_t size = 0;
+    for (size_t e=0; e<file->extent_count; e++) size += (uint64_t)file->extents[e].count*vol->cluster_size;
+    if(size>file->entry.file_size) size = file->entry.file_size;
+    if(offset>size) offset = size;
+    if(len>size-offset) len = size-offset;
+    if(len==0) {
+        fatum_fclose(file);
+        return SRV_OK;
+    }
+    stream->file = file;
+    stream->offset = offset;
+    stream->left = len;
+    return SRV_OK;
+}
+
+static int serve_fileinfo(fatum_t *vol, const char *path, response_t *r) {
+    entry_data_t *entry;
+    int ret = fatum_lookup(vol,path,&entry);
+    if(ret) return srv_status(ret,0);
+    fatum_stat_t st;
+    fatum_stat_entry(vol,entry,&st);
+    ret = response_printf(r,"File path: %s\nAttributes: %s %s %s %s %s %s\nFile size: %u\n",path,
+        (st.attributes & FAF_ARCHIVE)?"A+":"A-",(st.attributes & FAF_READ_ONLY)?"R+":"R-",
+        (st.attributes & FAF_SYSTEM_FILE)?"S+":"S-",(st.attributes & FAF_HIDDEN_FILE)?"H+":"H-",
+        (st.attributes & FAF_DIR)?"D+":"D-",(st.attributes & FAF_VOL_LABEL)?"V+":"V-",st.size);
+    if(ret==0) ret = response_printf(r,"Last modified: %02d/%02d/%04d %02d:%02d\nLast access: %02d/%02d/%04d\nCreated: %02d/%02d/%04d %02d:%02d\nClusters chain: ",
+        st.modified_date.day,st.modified_date.month,st.modified_date.year,st.modified_time.hrs,st.modified_time.min,
+        st.access_date.day,st.access_date.month,st.access_date.year,
+        st.created_date.day,st.created_date.month,st.created_date.year,st.created_time.hrs,st.created_time.min);
+    uint32_t cluster = st.first_cluster;
+    uint32_t clusters = 0;
+    while(ret==0 && fatum_valid_cluster(vol,cluster) && clusters<=vol->cluster_count) {
+        ret = response_printf(r,"%u ",cluster);
+        cluster = fatum_next_cluster(vol,cluster);
+        clusters++;
+    }
+    if(ret==0) ret = response_printf(r,"\nClusters count: %u\n",clusters);
+    return srv_status(ret,0);
+}
+
+static int serve_spaceinfo(fatum_t *vol, response_t *r) {
+    fatum_space_t space;
+    fatum_space(vol,&space,1);
+    int ret;
+    if(space.hinted) ret = response_printf(r,"Used clusters (with ending and corrupted): %u\nFree clusters: %u (FSInfo)\n",space.used,space.free);
+    else ret = response_printf(r,"Used clusters: %u\nFree clusters: %u\nCorrupted clusters: %u\nEnding clusters: %u\n",space.used,space.free,space.bad,space.last);
+    if(ret==0) ret = response_printf(r,"Cluster size in bytes: %u\nCluster size in sectors: %d\nFAT type: FAT%d\n",vol->cluster_size,vol->br.sectors_per_cluster,vol->fat_type);
+    return srv_status(ret,0);
+}
+
+// Fills r with the command's output, or stream with a file to send after it, and returns the status
+int handle_request(server_t *srv, char *request, response_t *r, stream_t *stream) {
+    char *save;
+    char *image = strtok_r(request," ",&save);
+    char *command = strtok_r(NULL," ",&save);
+    char *path = strtok_r(NULL," ",&save);
+    char *arg1 = path ? strtok_r(NULL," ",&save) : NULL;
+    char *arg2 = arg1 ? strtok_r(NULL," ",&save) : NULL;
+    if(image==NULL || command==NULL) return SRV_BAD_REQUEST;
+    if(!strcmp(command,"images")) {
+        for (int i=0; i<srv->volume_count; i++) {
+            if(response_printf(r,"%d %s\n",i,srv->volumes[i]->filename)) return SRV_NO_MEMORY;
+        }
+        return SRV_OK;
+    }
+    char *end;
+    long index = strtol(image,&end,10);
+    if(*end!='\0' || index<0 || index>=srv->volume_count) return SRV_BAD_REQUEST;
+    fatum_t *vol = srv->volumes[index];
+
+    if(!strcmp(command,"dir")) return serve_dir(vol,path?path:"",r);
+    if(!strcmp(command,"spaceinfo")) return serve_spaceinfo(vol,r);
+    if(path==NULL) return SRV_BAD_REQUEST;
+    if(!strcmp(command,"fileinfo")) return serve_fileinfo(vol,path,r);
+    if(!strcmp(command,"get")) return serve_file(vol,path,0,UINT32_MAX,stream);
+    if(!strcmp(command,"cat")) {
+        unsigned long offset = 0;
+        unsigned long len = UINT32_MAX;
+        if(arg1) {
+            offset = strtoul(arg1,&end,10);
+            if(*end!='\0' || offset>UINT32_MAX) return SRV_BAD_REQUEST;
+        }
+        if(arg2) {
+            len = strtoul(arg2,&end,10);
+            if(*end!='\0' || len>UINT32_MAX) return SRV_BAD_REQUEST;
+        }
+        return serve_file(vol,path,offset,len,stream);
+    }
+    return SRV_BAD_REQUEST;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while(len>0) {
+        ssize_t sent = send(fd,buf,len,MSG_NOSIGNAL);
+        if(sent<0) {
+            if(errno==EINTR) continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK) {
+                struct pollfd p = {fd,POLLOUT,0};
+                if(poll(&p,1,30000)<=0) return -1;
+                continue;
+            }
+            return -1;
+        }
+        buf+=sent;
+        len-=sent;
+    }
+    return 0;
+}
+
+// Maps the next piece of the streamed file, decompressing it for compressed images. Returns 0 or -1 if it can't be read
+static int next_piece(stream_t *stream) {
+    uint32_t n = stream->left<SERVER_CHUNK ? stream->left : SERVER_CHUNK;
+    ssize_t got = fatum_map(stream->file,stream->offset,n,&stream->piece);
+    if(got<=0) return -1;
+    stream->piece_left = got;
+    stream->offset+=got;
+    stream->left-=got;
+    return 0;
+}
+
+void *server_worker(void *arg) {
+    server_t *srv = arg;
+    while(1) {
+        pthread_mutex_lock(&srv->lock);
+        while(srv->head==NULL && !srv->stopping) pthread_cond_wait(&srv->ready,&srv->lock);
+        if(srv->head==NULL) {
+            pthread_mutex_unlock(&srv->lock);
+            break;
+        }
+        job_t *job = srv->head;
+        srv->head = job->next;
+        if(srv->head==NULL) srv->tail = NULL;
+        pthread_mutex_unlock(&srv->lock);
+
+        client_t *c = job->client;
+        free(job);
+        if(c->request==NULL) {
+            // The event loop only hands back a client mid-response when its next piece needs decompressing
+            if(next_piece(&c->stream)) c->closing = 1;
+            int slot = c-srv->clients;
+            if(write(srv->wake[1],&slot,sizeof(int))!=sizeof(int)) c->closing = 1;
+            continue;
+        }
+        response_t r = {NULL,0,0};
+        stream_t stream = {NULL,0,0,NULL,0};
+        int status = handle_request(srv,c->request,&r,&stream);
+        if(status!=SRV_OK) {
+            r.size = 0;
+            fatum_fclose(stream.file);
+            stream.file = NULL;
+            stream.left = 0;
+        }
+        // Sending is left to the event loop, so slow readers don't hold workers
+        uint32_t len = htonl(1+r.size+stream.left);
+        memcpy(c->frame,&len,4);
+        c->frame[4] = status;
+        c->out = r;
+        c->sent = 0;
+        c->stream = stream;
+        if(stream.file && stream.file->vol->zimage && next_piece(&c->stream)) c->closing = 1;
+
+        free(c->request);
+        c->request = NULL;
+        c->received = 0;
+        c->expected = 0;
+        int slot = c-srv->clients;
+        if(write(srv->wake[1],&slot,sizeof(int))!=sizeof(int)) c->closing = 1;
+    }
+    return NULL;
+}
+
+static void finish_response(client_t *c) {
+    free(c->out.buf);
+    memset(&c->out,0,sizeof(response_t));
+    fatum_fclose(c->stream.file);
+    memset(&c->stream,0,sizeof(stream_t));
+    c->sent = 0;
+    c->sending = 0;
+}
+
+static void close_client(client_t *c) {
+    finish_response(c);
+    close(c->fd);
+    free(c->request);
+    c->request = NULL;
+    c->fd = -1;
+    c->busy = 0;
+    c->closing = 0;
+    c->received = 0;
+    c->expected = 0;
+}
+
+// Returns 1 when a whole request frame is in, 0 if more is needed, -1 if the client should be closed
+static int read_client(client_t *c) {
+    while(1) {
+        ssize_t got;
+        if(c->received<4) got = read(c->fd,c->header+c->received,4-c->received);
+        else got = read(c->fd,c->request+(c->received-4),c->expected-(c->received-4));
+        if(got==0) return -1;
+        if(got<0) {
+            if(errno==EINTR) continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->received+=got;
+        if(c->received==4 && c->request==NULL) {
+            uint32_t len;
+            memcpy(&len,c->header,4);
+            c->expected = ntohl(len);
+            if(c->expected==0 || c->expected>SERVER_MAX_REQUEST) return -1;
+            c->request = malloc(c->expected+1);
+            if(c->request==NULL) return -1;
+        }
+        if(c->request && c->received-4==c->expected) {
+            c->request[c->expected] = '\0';
+            return 1;
+        }
+    }
+}
+
+static int enqueue(server_t *srv, client_t *c) {
+    job_t *job = malloc(sizeof(job_t));
+    if(job==NULL) return -5;
+    job->client = c;
+    job->next = NULL;
+    pthread_mutex_lock(&srv->lock);
+    if(srv->tail) srv->tail->next = job;
+    else srv->head = job;
+    srv->tail = job;
+    pthread_cond_signal(&srv->ready);
+    pthread_mutex_unlock(&srv->lock);
+    return 0;
+}
+
+// Writes as much of the response as the socket takes, straight from the volume's memory for file bodies.
+// Returns 1 when the whole response is sent, 0 if the socket is full, 2 if a worker has to decompress the next piece,
+// -1 if the client should be closed
+static int write_client(client_t *c) {
+    while(1) {
+        const char *p;
+        size_t len;
+        char body = 0;
+        if(c->sent<5) {
+            p = c->frame+c->sent;
+            len = 5-c->sent;
+        }
+        else if(c->sent<5+c->out.size) {
+            p = c->out.buf+(c->sent-5);
+            len = c->out.size-(c->sent-5);
+        }
+        else if(c->stream.piece_left>0) {
+            p = c->stream.piece;
+            len = c->stream.piece_left;
+            body = 1;
+        }
+        else if(c->stream.left==0) return 1;
+        else if(c->stream.file->vol->zimage) return 2;
+        // Header is already out, so a piece that can't be read only leaves closing the connection
+        else if(next_piece(&c->stream)) return -1;
+        else continue;
+        ssize_t n = send(c->fd,p,len,MSG_NOSIGNAL);
+        if(n<0) {
+            if(errno==EINTR) continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if(body) {
+            c->stream.piece+=n;
+            c->stream.piece_left-=n;
+        }
+        else c->sent+=n;
+    }
+}
+
+// Acts on write_client's result
+static void continue_response(server_t *srv, client_t *c) {
+    int ret = write_client(c);
+    if(ret<0) close_client(c);
+    else if(ret==1) finish_response(c);
+    else if(ret==2) {
+        c->busy = 1;
+        if(enqueue(srv,c)) close_client(c);
+    }
+}
+
+static void event_loop(server_t *srv) {
+    struct pollfd fds[SERVER_MAX_CLIENTS+2];
+    int slots[SERVER_MAX_CLIENTS+2];
+    while(!stop_requested) {
+        int n = 0;
+        fds[n].fd = srv->listen_fd;
+        fds[n++].events = POLLIN;
+        fds[n].fd = srv->wake[0];
+        fds[n++].events = POLLIN;
+        for (int i=0; i<SERVER_MAX_CLIENTS; i++) {
+            if(srv->clients[i].fd<0 || srv->clients[i].busy) continue;
+            fds[n].fd = srv->clients[i].fd;
+            fds[n].events = srv->clients[i].sending ? POLLOUT : POLLIN;
+            slots[n++] = i;
+        }
+        if(poll(fds,n,-1)<0) {
+            if(errno==EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if(fds[1].revents & POLLIN) {
+            int slot;
+            while(read(srv->wake[0],&slot,sizeof(int))==sizeof(int)) {
+                client_t *c = &srv->clients[slot];
+                c->busy = 0;
+                if(c->closing) {
+                    close_client(c);
+                    continue;
+                }
+                // Most responses fit the socket buffer right away
+                c->sending = 1;
+                continue_response(srv,c);
+            }
+        }
+        if(fds[0].revents & POLLIN) {
+            int fd;
+            while((fd=accept(srv->listen_fd,NULL,NULL))>=0) {
+                int i = 0;
+                while(i<SERVER_MAX_CLIENTS && srv->clients[i].fd>=0) i++;
+                if(i==SERVER_MAX_CLIENTS) {
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+                srv->clients[i].fd = fd;
+            }
+        }
+        for (int k=2; k<n; k++) {
+            if(!fds[k].revents) continue;
+            client_t *c = &srv->clients[slots[k]];
+            if(c->sending) {
+                continue_response(srv,c);
+                continue;
+            }
+            int ret = read_client(c);
+            if(ret<0) close_client(c);
+            else if(ret>0) {
+                c->busy = 1;
+                if(enqueue(srv,c)) close_client(c);
+            }
+        }
+    }
+}
+
+int run_server(const char *socket_path, char **images, int image_count) {
+    server_t srv;
+    memset(&srv,0,sizeof(server_t));
+    for (int i=0; i<SERVER_MAX_CLIENTS; i++) srv.clients[i].fd = -1;
+    srv.volumes = calloc(image_count,sizeof(fatum_t*));
+    if(srv.volumes==NULL) {
+        printf("Error: allocation error\n");
+        return 3;
+    }
+    int ret = 0;
+    for (; srv.volume_count<image_count; srv.volume_count++) {
+        fatum_t *vol;
+        ret = fatum_open(images[srv.volume_count],&vol);
+        if(ret) {
+            printf("Error: Can't load %s\n",images[srv.volume_count]);
+            break;
+        }
+        srv.volumes[srv.volume_count] = vol;
+        // FAT mirrors are compared once here instead of on every request
+        if(vol->mirrored && vol->br.number_of_fats>1 && memcmp(vol->fats[0],vol->fats[1],vol->fat_bytes)) {
+            printf("Error: FAT copies of %s differ\n",images[srv.volume_count]);
+            srv.volume_count++;
+            ret = -1;
+            break;
+        }
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(ret==0 && strlen(socket_path)>=sizeof(addr.sun_path)) {
+        printf("Error: socket path too long\n");
+        ret = 1;
+    }
+    srv.listen_fd = -1;
+    srv.wake[0] = srv.wake[1] = -1;
+    if(ret==0) {
+        strcpy(addr.sun_path,socket_path);
+        unlink(socket_path);
+        srv.listen_fd = socket(AF_UNIX,SOCK_STREAM,0);
+        if(srv.listen_fd<0 || bind(srv.listen_fd,(struct sockaddr*)&addr,sizeof(addr)) || listen(srv.listen_fd,64) || pipe(srv.wake)) {
+            perror("Error: can't listen on socket");
+            ret = 2;
+        }
+    }
+    if(ret==0) {
+        fcntl(srv.listen_fd,F_SETFL,fcntl(srv.listen_fd,F_GETFL)|O_NONBLOCK);
+        fcntl(srv.wake[0],F_SETFL,fcntl(srv.wake[0],F_GETFL)|O_NONBLOCK);
+        struct sigaction sa;
+        memset(&sa,0,sizeof(sa));
+        sa.sa_handler = request_stop;
+        sigaction(SIGINT,&sa,NULL);
+        sigaction(SIGTERM,&sa,NULL);
+        signal(SIGPIPE,SIG_IGN);
+        pthread_mutex_init(&srv.lock,NULL);
+        pthread_cond_init(&srv.ready,NULL);
+        int started = 0;
+        for (; started<SERVER_WORKERS; started++) {
+            if(pthread_create(&srv.workers[started],NULL,server_worker,&srv)) break;
+        }
+        if(started==0) {
+            printf("Error: can't start workers\n");
+            ret = 3;
+        }
+        else {
+            printf("Serving %d image(s) on %s\n",srv.volume_count,socket_path);
+            fflush(stdout);
+            event_loop(&srv);
+        }
+        pthread_mutex_lock(&srv.lock);
+        srv.stopping = 1;
+        pthread_cond_broadcast(&srv.ready);
+        pthread_mutex_unlock(&srv.lock);
+        for (int i=0; i<started; i++) pthread_join(srv.workers[i],NULL);
+        while(srv.head) {
+            job_t *next = srv.head->next;
+            free(srv.head);
+            srv.head = next;
+        }
+        for (int i=0; i<SERVER_MAX_CLIENTS; i++) if(srv.clients[i].fd>=0) close_client(&srv.clients[i]);
+        pthread_cond_destroy(&srv.ready);
+        pthread_mutex_destroy(&srv.lock);
+        unlink(socket_path);
+    }
+    if(srv.listen_fd>=0) close(srv.listen_fd);
+    if(srv.wake[0]>=0) close(srv.wake[0]);
+    if(srv.wake[1]>=0) close(srv.wake[1]);
+    for (int i=0; i<srv.volume_count; i++) fatum_close(srv.volumes[i]);
+    free(srv.volumes);
+    return ret;
+}
+
+int run_client(const char *socket_path, const char *request) {
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path)>=sizeof(addr.sun_path)) {
+        fprintf(stderr,"Error: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path,socket_path);
+    size_t len = strlen(request);
+    if(len==0 || len>SERVER_MAX_REQUEST) {
+        fprintf(stderr,"Error: wrong request\n");
+        return 1;
+    }
+    int fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if(fd<0 || connect(fd,(struct sockaddr*)&addr,sizeof(addr))) {
+        perror("Error: can't connect");
+        if(fd>=0) close(fd);
+        return 2;
+    }
+    uint32_t header = htonl(len);
+    if(send_all(fd,(char*)&header,4) || send_all(fd,request,len)) {
+        close(fd);
+        return 2;
+    }
+    char buf[65536];
+    size_t received = 0;
+    uint32_t expected = 0;
+    char status = SRV_OK;
+    while(1) {
+        ssize_t got = read(fd,buf,sizeof(buf));
+        if(got<0 && errno==EINTR) continue;
+        if(got<=0) break;
+        char *p = buf;
+        while(got>0 && received<5) {
+            if(received<4) expected = (expected<<8)|(unsigned char)*p;
+            else status = *p;
+            p++;
+            got--;
+            received++;
+        }
+        if(got>0) fwrite(p,sizeof(char),got,stdout);
+        received+=got;
+        if(received>=5 && received-4>=expected) break;
+    }
+    close(fd);
+    if(received<5) {
+        fprintf(stderr,"Error: no response\n");
+        return 2;
+    }
+    if(status!=SRV_OK) fprintf(stderr,"Error: status %d\n",status);
+    return status;
+}
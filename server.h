@@ -0,0 +1,80 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include "libfatum.h"
+
+#define SERVER_WORKERS 4
+#define SERVER_MAX_CLIENTS 256
+#define SERVER_MAX_REQUEST 4096
+
+// Frames are a 4-byte big-endian payload length followed by the payload.
+// Request payload: "<image> <command> [args]", image being the index of a served image.
+// Response payload: 1 status byte followed by the command's output.
+#define SRV_OK 0
+#define SRV_BAD_REQUEST 1
+#define SRV_NOT_FOUND 2
+#define SRV_IS_DIR 3
+#define SRV_NOT_DIR 4
+#define SRV_CORRUPTED 5
+#define SRV_NO_MEMORY 6
+
+#define SERVER_CHUNK (1<<16) // largest piece of a file body prepared at once
+
+typedef struct response {
+    char *buf;
+    size_t size;
+    size_t cap;
+} response_t;
+
+// File body sent after a response's text, one piece of file memory at a time
+typedef struct stream {
+    fatum_file_t *file; // NULL if there's nothing to stream
+    uint32_t offset; // of the next piece
+    uint32_t left; // after the current piece
+    const char *piece; // unsent part of the current piece, inside the volume's data area
+    size_t piece_left;
+} stream_t;
+
+typedef struct client {
+    int fd; // -1 if the slot is free
+    char busy; // request handed to a worker, not polled until it's returned
+    char sending; // response is being written by the event loop
+    char closing; // worker couldn't return the client
+    char header[4];
+    size_t received;
+    uint32_t expected; // payload length, read after the header
+    char *request;
+    char frame[5]; // response length and status
+    response_t out; // response text
+    size_t sent; // bytes of frame and out written so far
+    stream_t stream;
+} client_t;
+
+typedef struct job {
+    client_t *client;
+    struct job *next;
+} job_t;
+
+typedef struct server {
+    fatum_t **volumes;
+    int volume_count;
+    int listen_fd;
+    int wake[2]; // workers return clients to the event loop through this pipe
+    client_t clients[SERVER_MAX_CLIENTS];
+    pthread_t workers[SERVER_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    job_t *head;
+    job_t *tail;
+    char stopping;
+} server_t;
+
+int run_server(const char *socket_path, char **images, int image_count);
+int run_client(const char *socket_path, const char *request);
+int response_reserve(response_t *r, size_t len);
+int response_printf(response_t *r, const char *fmt, ...);
+int handle_request(server_t *srv, char *request, response_t *r, stream_t *stream);
+void *server_worker(void *arg);
+
+#endif //SERVER_H